@@ -0,0 +1,1239 @@
+#include <iostream>
+#include "multi.h"
+#include <stdio.h>
+#include <vector>
+#include <random>
+#include <atomic>
+#include <algorithm>
+#include <string>
+#include <string.h>
+#include <future>
+#include <ctime>
+#include <climits>
+
+// Benchmarks, these are not part of the tests. Build in release mode!
+
+// The timer sweep the subsystem used before the timing wheel, kept around to compare against
+struct legacy_timer {
+    multi::timer<multi::milliseconds> t;
+    long long set;
+    char type;
+};
+size_t legacy_sweep(multi::node<multi::mobj>& timedObjects) {
+    size_t due = 0;
+    multi::node<multi::mobj>* current = timedObjects.next;
+    while (current != nullptr) {
+        auto tester = (legacy_timer*)current->data->obj;
+        switch (tester->type)
+        {
+        case multi::_millisecond:
+            if (tester->t.get() >= tester->set)
+                due++;
+            break;
+        default:
+            break;
+        }
+        current = current->next;
+    }
+    return due;
+}
+// Runs f until at least min_time has passed, returns the average cost of one call in nanoseconds
+template<typename F>
+double measure(F f, multi::milliseconds min_time = multi::milliseconds(500), size_t min_runs = 3) {
+    size_t runs = 0;
+    auto start = multi::Clock::now();
+    auto elapsed = multi::Clock::now() - start;
+    while (runs < min_runs || elapsed < min_time) {
+        f();
+        runs++;
+        elapsed = multi::Clock::now() - start;
+    }
+    return (double)std::chrono::duration_cast<multi::nanoseconds>(elapsed).count() / runs;
+}
+// The value that p percent of the sorted samples are at or below
+long long percentile(const std::vector<long long>& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    size_t i = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+    return sorted[i];
+}
+// Every benchmark also reports its numbers here, main writes them out as JSON when asked to
+struct result {
+    std::string bench;
+    std::vector<std::pair<std::string, std::string>> params;
+    std::vector<std::pair<std::string, double>> metrics;
+};
+static std::vector<result> results;
+void report(const char* bench, std::vector<std::pair<std::string, std::string>> params, std::vector<std::pair<std::string, double>> metrics) {
+    results.push_back({ bench, std::move(params), std::move(metrics) });
+}
+// Guarantees a benchmark relies on, a broken one makes multi_bench exit with 1 after every benchmark ran
+static int failures = 0;
+void require(bool ok, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+std::string json_string(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+void write_json(FILE* f) {
+    fprintf(f, "{\n  \"logical_cores\": %u,\n  \"physical_cores\": %u,\n  \"numa_nodes\": %zu,\n  \"results\": [",
+        multi::GetLogicalCoreCount(), multi::GetPhysicalCoreCount(), multi::GetTopology().getNodeCount());
+    for (size_t i = 0; i < results.size(); i++) {
+        auto& r = results[i];
+        fprintf(f, "%s\n    { \"bench\": %s, \"params\": {", i ? "," : "", json_string(r.bench).c_str());
+        for (size_t j = 0; j < r.params.size(); j++)
+            fprintf(f, "%s %s: %s", j ? "," : "", json_string(r.params[j].first).c_str(), json_string(r.params[j].second).c_str());
+        fprintf(f, " }, \"metrics\": {");
+        for (size_t j = 0; j < r.metrics.size(); j++)
+            fprintf(f, "%s %s: %.6g", j ? "," : "", json_string(r.metrics[j].first).c_str(), r.metrics[j].second);
+        fprintf(f, " } }");
+    }
+    fprintf(f, "\n  ]\n}\n");
+}
+void bench_timer_sweep() {
+    using namespace std;
+    cout << "Timer sweep cost, deadlines spread over 1-60 seconds so nothing is due" << endl;
+    size_t sizes[] = { 1000, 100000, 1000000 };
+    for (size_t n : sizes) {
+        mt19937_64 rng(n);
+        uniform_int_distribution<long long> dist(1000, 60000);
+        vector<multi::mobj*> objs;
+        vector<legacy_timer> timers(n);
+        objs.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            auto m = new multi::mobj("alarm");
+            timers[i].t.start();
+            timers[i].set = dist(rng);
+            timers[i].type = multi::_millisecond;
+            m->obj = &timers[i];
+            objs.push_back(m);
+        }
+        multi::node<multi::mobj> list;
+        for (auto m : objs)
+            list.addNode(m);
+        double list_ns = measure([&] { legacy_sweep(list); });
+
+        multi::timer_wheel wheel;
+        auto t0 = multi::Clock::now();
+        for (size_t i = 0; i < n; i++)
+            wheel.insert(objs[i], timers[i].t.deadline(timers[i].set));
+        auto insert_ns = (double)chrono::duration_cast<multi::nanoseconds>(multi::Clock::now() - t0).count() / n;
+        size_t expired = 0;
+        double wheel_ns = measure([&] { expired += wheel.advance(multi::Clock::now(), [](multi::mobj*) {}); });
+
+        printf("  %8zu timers | list sweep: %14.1f ns | wheel sweep: %8.1f ns | wheel insert: %6.1f ns/timer | expired: %zu\n",
+            n, list_ns, wheel_ns, insert_ns, expired);
+        report("timer_sweep", { { "timers", to_string(n) } }, { { "list_sweep_ns", list_ns }, { "wheel_sweep_ns", wheel_ns }, { "wheel_insert_ns", insert_ns } });
+
+        multi::node<multi::mobj>* current = list.next;
+        while (current != nullptr) {
+            auto next = current->next;
+            delete current;
+            current = next;
+        }
+        for (auto m : objs)
+            delete m;
+    }
+}
+struct queue_item {
+    std::atomic<queue_item*> next{ nullptr };
+    size_t value = 0;
+};
+// Every producer pushes per_producer items, the consumer takes them out until it has seen them all
+template<typename Push, typename Consume>
+double run_producers(size_t producers, size_t per_producer, Push push, Consume consume) {
+    std::vector<std::thread> threads;
+    auto start = multi::Clock::now();
+    for (size_t p = 0; p < producers; p++)
+        threads.emplace_back([&, p] {
+            for (size_t i = 0; i < per_producer; i++)
+                push(p, i);
+        });
+    consume(producers * per_producer);
+    auto elapsed = multi::Clock::now() - start;
+    for (auto& t : threads)
+        t.join();
+    return (double)std::chrono::duration_cast<multi::nanoseconds>(elapsed).count() / (producers * per_producer);
+}
+void bench_queue_contention() {
+    using namespace std;
+    cout << "Queue contention, one consumer" << endl;
+    const size_t total = 1 << 20;
+    size_t counts[] = { 1, 4, 16 };
+    for (size_t producers : counts) {
+        size_t per = total / producers;
+        vector<queue_item> items(per * producers);
+
+        multi::Queue<queue_item*> locked;
+        double locked_ns = run_producers(producers, per,
+            [&](size_t p, size_t i) { locked.push(&items[p * per + i]); },
+            [&](size_t n) { for (size_t i = 0; i < n; i++) locked.pop(); });
+
+        multi::mpsc_queue<queue_item, &queue_item::next> lockfree;
+        double popped_ns = run_producers(producers, per,
+            [&](size_t p, size_t i) { lockfree.push(&items[p * per + i]); },
+            [&](size_t n) {
+                queue_item* item;
+                while (n) {
+                    if (lockfree.try_pop(item))
+                        n--;
+                    else
+                        lockfree.wait();
+                }
+            });
+
+        multi::mpsc_queue<queue_item, &queue_item::next> batched;
+        double drained_ns = run_producers(producers, per,
+            [&](size_t p, size_t i) { batched.push(&items[p * per + i]); },
+            [&](size_t n) {
+                while (n) {
+                    batched.wait();
+                    for (queue_item* item = batched.drain_all(); item; item = batched.next(item))
+                        n--;
+                }
+            });
+
+        printf("  %2zu producers | Queue: %7.1f ns/item | mpsc try_pop: %7.1f ns/item | mpsc drain_all: %7.1f ns/item\n",
+            producers, locked_ns, popped_ns, drained_ns);
+        report("queue_contention", { { "producers", to_string(producers) } },
+            { { "queue_ns_per_item", locked_ns }, { "mpsc_try_pop_ns_per_item", popped_ns }, { "mpsc_drain_all_ns_per_item", drained_ns } });
+    }
+}
+void bench_object_churn() {
+    using namespace std;
+    cout << "Object churn, create and destroy in rounds of 1000 objects" << endl;
+    multi::runner run;
+    vector<multi::mobj*> objs;
+    objs.reserve(1000);
+    auto churn = [&] {
+        for (int i = 0; i < 1000; i++)
+            objs.push_back(run.newLoop([](multi::mobj*) { return true; }));
+        for (auto m : objs)
+            run.destroy(m);
+        objs.clear();
+        run.update();
+    };
+    churn(); // Warm up
+    size_t warm = run.getAllocationCount();
+    double loop_ns = measure(churn) / 1000;
+    printf("  loops  | %6.1f ns per create+destroy | heap allocations after warm up: %zu\n", loop_ns, run.getAllocationCount() - warm);
+    report("object_churn", { { "kind", "loop" } }, { { "ns_per_object", loop_ns }, { "allocations_after_warm_up", (double)(run.getAllocationCount() - warm) } });
+    require(run.getAllocationCount() == warm, "object_churn: creating and destroying loops allocated after the warm up");
+
+    static atomic<int> fired;
+    auto alarms = [&] {
+        fired = 0;
+        for (int i = 0; i < 1000; i++)
+            objs.push_back(run.setAlarm<multi::nanoseconds>(0, [](multi::mobj*) { fired++; return true; }));
+        while (fired < 1000)
+            run.update();
+        for (auto m : objs)
+            run.destroy(m);
+        objs.clear();
+        run.update();
+    };
+    alarms();
+    warm = run.getAllocationCount();
+    double alarm_ns = measure(alarms) / 1000;
+    printf("  alarms | %6.1f ns per create+fire+destroy | heap allocations after warm up: %zu\n", alarm_ns, run.getAllocationCount() - warm);
+    report("object_churn", { { "kind", "alarm" } }, { { "ns_per_object", alarm_ns }, { "allocations_after_warm_up", (double)(run.getAllocationCount() - warm) } });
+    require(run.getAllocationCount() == warm, "object_churn: creating, firing and destroying alarms allocated after the warm up");
+
+    // The runner loops on its own thread, the objects are handed over and taken in at the start of its passes
+    multi::runner threaded(true);
+    threaded.loop();
+    auto remote = [&] {
+        for (int i = 0; i < 1000; i++)
+            objs.push_back(threaded.newLoop([](multi::mobj*) { return true; }));
+        for (auto m : objs)
+            threaded.destroy(m);
+        objs.clear();
+    };
+    double remote_ns = measure(remote) / 1000;
+    printf("  loops from another thread | %6.1f ns per create+destroy\n", remote_ns);
+    report("object_churn", { { "kind", "remote_loop" } }, { { "ns_per_object", remote_ns } });
+}
+// How an object kept its timer before timed_state, three pointers to separate allocations and a runtime unit switch
+struct legacy_timed {
+    void* reserved1;
+    void* reserved2;
+    void* reserved3;
+};
+template<typename T>
+inline bool legacy_check(const legacy_timed& o) {
+    return ((multi::timer<T>*)o.reserved1)->get() >= *(long long*)o.reserved2;
+}
+bool legacy_expired(const legacy_timed& o) {
+    switch (*(char*)o.reserved3)
+    {
+    case multi::_nanosecond: return legacy_check<multi::nanoseconds>(o);
+    case multi::_microsecond: return legacy_check<multi::microseconds>(o);
+    case multi::_millisecond: return legacy_check<multi::milliseconds>(o);
+    case multi::_second: return legacy_check<multi::seconds>(o);
+    case multi::_minute: return legacy_check<multi::minutes>(o);
+    case multi::_hour: return legacy_check<multi::hours>(o);
+    default: return false;
+    }
+}
+void bench_timer_check() {
+    using namespace std;
+    cout << "Per timer expiry check, 1M timers" << endl;
+    const size_t n = 1000000;
+    mt19937_64 rng(1);
+    vector<legacy_timed> before(n);
+    vector<multi::timed_state> after(n);
+    for (size_t i = 0; i < n; i++) {
+        long long set = 1000 + rng() % 60000;
+        auto t = new multi::timer<multi::milliseconds>;
+        t->start();
+        before[i].reserved1 = t;
+        before[i].reserved2 = new long long(set);
+        before[i].reserved3 = new char(multi::_millisecond);
+        after[i].setPeriod<multi::milliseconds>(set);
+        after[i].start();
+    }
+    size_t due = 0;
+    double before_ns = measure([&] {
+        for (auto& o : before)
+            due += legacy_expired(o);
+    }) / n;
+    double after_ns = measure([&] {
+        auto now = multi::Clock::now();
+        for (auto& o : after)
+            due += o.expired(now);
+    }) / n;
+    printf("  void* + unit switch: %6.2f ns/check | timed_state: %6.2f ns/check | (%zu due)\n", before_ns, after_ns, due);
+    report("timer_check", { { "timers", to_string(n) } }, { { "legacy_ns_per_check", before_ns }, { "timed_state_ns_per_check", after_ns } });
+    for (auto& o : before) {
+        delete (multi::timer<multi::milliseconds>*)o.reserved1;
+        delete (long long*)o.reserved2;
+        delete (char*)o.reserved3;
+    }
+}
+void bench_clock_sources() {
+    using namespace std;
+    cout << "Clock sources, cost of a reading and per timer expiry check over 1M timers" << endl;
+    const size_t n = 1000000;
+    mt19937_64 rng(1);
+    vector<multi::timed_state> timers(n);
+    for (auto& t : timers) {
+        t.setPeriod<multi::milliseconds>(1000 + rng() % 60000);
+        t.start();
+    }
+    struct {
+        const char* name;
+        multi::clock_source source;
+    } sources[] = { { "standard", multi::clock_source::standard }, { "monotonic", multi::clock_source::monotonic },
+        { "monotonic_coarse", multi::clock_source::monotonic_coarse }, { "tsc", multi::clock_source::tsc } };
+    size_t due = 0;
+    for (auto& c : sources) {
+        if (!multi::HasClockSource(c.source)) {
+            printf("  %-16s | not available\n", c.name);
+            continue;
+        }
+        const size_t reads = 1000000;
+        long long sink = 0;
+        double read_ns = measure([&] {
+            for (size_t i = 0; i < reads; i++)
+                sink += multi::ClockNs(multi::Now(c.source));
+        }) / reads;
+        // Smallest step the clock makes
+        long long step = LLONG_MAX;
+        for (int i = 0; i < 1000; i++) {
+            long long a = multi::ClockNs(multi::Now(c.source)), b;
+            while ((b = multi::ClockNs(multi::Now(c.source))) == a);
+            step = min(step, b - a);
+        }
+        double each_ns = measure([&] {
+            for (auto& t : timers)
+                due += t.expired(multi::Now(c.source));
+        }) / n;
+        double sampled_ns = measure([&] {
+            auto now = multi::Now(c.source);
+            for (auto& t : timers)
+                due += t.expired(now);
+        }) / n;
+        printf("  %-16s | read: %6.2f ns, resolution: %9lld ns | check reading per timer: %6.2f ns | check one reading per sweep: %6.2f ns | (%zu due)%s\n",
+            c.name, read_ns, step, each_ns, sampled_ns, due, sink ? "" : " ");
+        report("clock_sources", { { "source", c.name }, { "timers", to_string(n) } }, { { "read_ns", read_ns }, { "resolution_ns", (double)step },
+            { "check_ns_reading_per_timer", each_ns }, { "check_ns_sampled_per_sweep", sampled_ns } });
+    }
+}
+// Dispatch latency of one very_high task, measured as the gap between two of its runs, while 10k low tasks share the runner
+static std::vector<long long> gaps;
+static multi::time last_dispatch;
+static volatile size_t low_work = 0;
+void bench_priority_latency() {
+    using namespace std;
+    cout << "Dispatch latency of a very_high task under 10k low tasks" << endl;
+    multi::scheduler schemes[] = { multi::scheduler::round_robin, multi::scheduler::priority };
+    const char* names[] = { "round_robin", "priority" };
+    for (int i = 0; i < 2; i++) {
+        multi::runner run;
+        for (int t = 0; t < 10000; t++) {
+            auto m = run.newLoop([](multi::mobj*) {
+                for (int w = 0; w < 50; w++)
+                    low_work = low_work + 1;
+                return true;
+            });
+            run.setPriority(m, multi::priority::low);
+        }
+        gaps.clear();
+        last_dispatch = multi::time();
+        auto hp = run.newLoop([](multi::mobj*) {
+            auto now = multi::Clock::now();
+            if (last_dispatch != multi::time())
+                gaps.push_back(chrono::duration_cast<multi::nanoseconds>(now - last_dispatch).count());
+            last_dispatch = now;
+            return true;
+        });
+        run.setPriority(hp, multi::priority::very_high);
+        run.setScheme(schemes[i]);
+        size_t before = low_work;
+        auto start = multi::Clock::now();
+        while (multi::Clock::now() - start < multi::milliseconds(500))
+            run.update();
+        double low_rate = (double)(low_work - before) / 50 / 0.5;
+        sort(gaps.begin(), gaps.end());
+        if (gaps.empty())
+            gaps.push_back(0);
+        printf("  %-11s | p50: %9.2f us | p99: %9.2f us | max: %9.2f us | low task runs/s: %.0f\n", names[i],
+            gaps[gaps.size() / 2] / 1000.0, gaps[gaps.size() * 99 / 100] / 1000.0, gaps.back() / 1000.0, low_rate);
+        report("priority_latency", { { "scheduler", names[i] } }, { { "p50_ns", (double)percentile(gaps, 50) }, { "p99_ns", (double)percentile(gaps, 99) },
+            { "max_ns", (double)gaps.back() }, { "low_runs_per_second", low_rate } });
+    }
+    // A single low task with nothing above it has to run on every pass, the priority scheduler must not hold it back
+    cout << "Runs of a lone low task per pass" << endl;
+    for (int i = 0; i < 2; i++) {
+        multi::runner run;
+        auto m = run.newLoop([](multi::mobj*) {
+            low_work = low_work + 1;
+            return true;
+        });
+        run.setPriority(m, multi::priority::low);
+        run.setScheme(schemes[i]);
+        size_t before = low_work;
+        const size_t passes = 100000;
+        for (size_t p = 0; p < passes; p++)
+            run.update();
+        double per_pass = (double)(low_work - before) / passes;
+        printf("  %-11s | %.3f runs/pass\n", names[i], per_pass);
+        report("priority_latency", { { "scheduler", names[i] }, { "case", "lone_low" } }, { { "runs_per_pass", per_pass } });
+    }
+}
+// A pass over a linked list of separately allocated objects, the way the runner stored its tasks before task_table
+size_t list_pass(multi::node<multi::mobj>& tasks) {
+    size_t ran = 0;
+    multi::node<multi::mobj>* current = tasks.next;
+    while (current != nullptr) {
+        ran += current->data->run(current->data, nullptr);
+        current = current->next;
+    }
+    return ran;
+}
+void bench_task_passes() {
+    using namespace std;
+    cout << "Scheduler passes per second over trivial tasks" << endl;
+    size_t sizes[] = { 10, 1000, 100000, 1000000 };
+    for (size_t n : sizes) {
+        multi::node<multi::mobj> list;
+        vector<multi::mobj*> objs;
+        for (size_t i = 0; i < n; i++) {
+            auto m = new multi::mobj("loop");
+            m->run = [](multi::mobj*, multi::runner*) { return true; };
+            objs.push_back(m);
+            list.addNode(m);
+        }
+        double list_ns = measure([&] { list_pass(list); });
+
+        multi::runner run;
+        for (size_t i = 0; i < n; i++)
+            run.newLoop([](multi::mobj*) { return true; });
+        double table_ns = measure([&] { run.update(); });
+
+        printf("  %8zu tasks | linked list: %12.1f passes/s | task_table: %12.1f passes/s\n", n, 1e9 / list_ns, 1e9 / table_ns);
+        report("round_robin_passes", { { "tasks", to_string(n) } }, { { "list_passes_per_second", 1e9 / list_ns }, { "passes_per_second", 1e9 / table_ns } });
+
+        multi::node<multi::mobj>* current = list.next;
+        while (current != nullptr) {
+            auto next = current->next;
+            delete current;
+            current = next;
+        }
+        for (auto m : objs)
+            delete m;
+    }
+}
+// 100k alarms that are far away plus a handful of loops. Before the readyQueue every alarm was polled on every pass
+void bench_idle_alarms() {
+    using namespace std;
+    cout << "Passes per second with 100k idle alarms and 10 loops" << endl;
+    const size_t n = 100000;
+    multi::runner polled;
+    static atomic<bool> never{ false };
+    for (size_t i = 0; i < n; i++)
+        polled.newLoop([](multi::mobj*) {
+            if (never.load(memory_order_relaxed))
+                return true; // What every alarm did on every pass: check its ready flag
+            return false;
+        });
+    for (int i = 0; i < 10; i++)
+        polled.newLoop([](multi::mobj*) { return true; });
+    double polled_ns = measure([&] { polled.update(); });
+
+    multi::runner queued;
+    for (size_t i = 0; i < n; i++)
+        queued.setAlarm<multi::seconds>(60 + i % 60, [](multi::mobj*) { return true; });
+    for (int i = 0; i < 10; i++)
+        queued.newLoop([](multi::mobj*) { return true; });
+    double queued_ns = measure([&] { queued.update(); });
+    printf("  polling every alarm: %12.1f passes/s | readyQueue: %12.1f passes/s\n", 1e9 / polled_ns, 1e9 / queued_ns);
+    report("idle_alarms", { { "alarms", to_string(n) } }, { { "polled_passes_per_second", 1e9 / polled_ns }, { "passes_per_second", 1e9 / queued_ns } });
+}
+// Scheduler passes over objects whose memory is on the node of the looping thread, and over objects on another node.
+// On a machine with one node both runs are local, the numbers should then match
+void bench_numa_passes() {
+    using namespace std;
+    auto& topo = multi::GetTopology();
+    size_t nodes = topo.getNodeCount();
+    cout << "Passes per second over 100k loops, memory local vs remote to the looping thread (" << nodes << " numa node" << (nodes == 1 ? ")" : "s)") << endl;
+    const size_t n = 100000;
+    int here = 0;
+    int there = nodes > 1 ? 1 : 0;
+    multi::SetAffinityNode(here);
+    auto pass_rate = [&](int node) {
+        multi::runner run(false, node);
+        for (size_t i = 0; i < n; i++)
+            run.newLoop([](multi::mobj*) { return true; });
+        return 1e9 / measure([&] { run.update(); });
+    };
+    double local = pass_rate(here);
+    double remote = pass_rate(there);
+    printf("  local (node %d): %10.1f passes/s | remote (node %d): %10.1f passes/s%s\n", here, local, there, remote, nodes > 1 ? "" : " (single node, not really remote)");
+    report("numa_passes", { { "nodes", to_string(nodes) } }, { { "local_passes_per_second", local }, { "remote_passes_per_second", remote } });
+    multi::SetAffinity(topo.all());
+}
+// A step with a lot of cheap iterations next to a loop. The budget trades the step's throughput against how long a pass takes
+static size_t step_iterations = 0;
+void bench_step_budget() {
+    using namespace std;
+    cout << "Step iterations per second and pass time for different step budgets" << endl;
+    long long budgets[] = { 0, 10, 100, 1000 };
+    for (long long us : budgets) {
+        multi::runner run;
+        run.setStepBudget(multi::microseconds(us));
+        step_iterations = 0;
+        run.newStep(0, INT32_MAX - 1, 1, [](multi::mobj*, size_t) { step_iterations++; return true; });
+        run.newLoop([](multi::mobj*) { return true; });
+        vector<long long> passes;
+        auto start = multi::Clock::now();
+        auto last = start;
+        while (last - start < multi::milliseconds(300)) {
+            run.update();
+            auto now = multi::Clock::now();
+            passes.push_back(chrono::duration_cast<multi::nanoseconds>(now - last).count());
+            last = now;
+        }
+        double secs = chrono::duration<double>(last - start).count();
+        sort(passes.begin(), passes.end());
+        printf("  budget %5lld us: %12.1f iterations/s | p50 pass %9.2f us | p99 pass %9.2f us\n", us, step_iterations / secs,
+            passes[passes.size() / 2] / 1000.0, passes[passes.size() * 99 / 100] / 1000.0);
+        report("step_budget", { { "budget_us", to_string(us) } }, { { "iterations_per_second", step_iterations / secs },
+            { "p50_pass_ns", (double)percentile(passes, 50) }, { "p99_pass_ns", (double)percentile(passes, 99) } });
+    }
+}
+// How fast alarms can be set, and how long the subsystem takes until it has filed them all into the wheel
+// Runs set, then waits for the subsystem to file everything. Returns the ns per alarm of both
+template<typename Set>
+std::pair<double, double> time_alarm_insert(size_t n, Set set) {
+    multi::runner run;
+    auto start = multi::Clock::now();
+    set(run);
+    auto done = multi::Clock::now();
+    while (!run.timeQueue.empty())
+        std::this_thread::yield();
+    auto filed = multi::Clock::now();
+    return { (double)std::chrono::duration_cast<multi::nanoseconds>(done - start).count() / n,
+        (double)std::chrono::duration_cast<multi::nanoseconds>(filed - start).count() / n };
+}
+void bench_alarm_insert() {
+    using namespace std;
+    cout << "setAlarm and setAlarms throughput, alarms far in the future" << endl;
+    size_t sizes[] = { 1000, 100000, 1000000 };
+    for (size_t n : sizes) {
+        auto single = time_alarm_insert(n, [n](multi::runner& run) {
+            for (size_t i = 0; i < n; i++)
+                run.setAlarm<multi::seconds>(3600 + i % 3600, [](multi::mobj*) { return true; });
+        });
+        vector<multi::alarm_spec> specs(n);
+        for (size_t i = 0; i < n; i++)
+            specs[i] = { (long long)(3600 + i % 3600), [](multi::mobj*) { return true; } };
+        auto batch = time_alarm_insert(n, [&](multi::runner& run) {
+            run.setAlarms<multi::seconds>(specs.data(), n);
+        });
+        printf("  %8zu alarms | setAlarm: %7.1f ns/alarm, until filed: %7.1f ns/alarm | setAlarms: %7.1f ns/alarm, until filed: %7.1f ns/alarm\n",
+            n, single.first, single.second, batch.first, batch.second);
+        report("alarm_insert", { { "alarms", to_string(n) } }, { { "set_ns_per_alarm", single.first }, { "filed_ns_per_alarm", single.second },
+            { "batch_set_ns_per_alarm", batch.first }, { "batch_filed_ns_per_alarm", batch.second } });
+    }
+}
+// 1M timeouts of which 90% are dealt with before they fire, the way request timeouts are. Each operation is timed on the runner's thread,
+// until settled also waits for the subsystem to take every touched timer out of or back into the wheel
+void bench_timer_cancel() {
+    using namespace std;
+    cout << "Cancelling, resetting and re-perioding 90% of 1M timeouts" << endl;
+    const size_t n = 1000000;
+    vector<multi::alarm_spec> specs(n);
+    for (size_t i = 0; i < n; i++)
+        specs[i] = { (long long)(30 + i % 30), [](multi::mobj*) { return true; } };
+    struct {
+        const char* op;
+        void (*apply)(multi::runner&, multi::mobj*);
+    } ops[] = {
+        { "cancel", [](multi::runner& run, multi::mobj* m) { run.cancel(m); } },
+        { "destroy", [](multi::runner& run, multi::mobj* m) { run.destroy(m); } },
+        { "reset", [](multi::runner& run, multi::mobj* m) { run.reset(m); } },
+        { "setPeriod", [](multi::runner& run, multi::mobj* m) { run.setPeriod<multi::seconds>(m, 90); } },
+    };
+    for (auto& op : ops) {
+        multi::runner run;
+        auto start = multi::Clock::now();
+        vector<multi::mobj*> objs = run.setAlarms<multi::seconds>(specs);
+        double create_ns = (double)chrono::duration_cast<multi::nanoseconds>(multi::Clock::now() - start).count() / n;
+        while (!run.timeQueue.empty())
+            this_thread::yield();
+        start = multi::Clock::now();
+        for (size_t i = 0; i < n; i++)
+            if (i % 10)
+                op.apply(run, objs[i]);
+        auto applied = multi::Clock::now();
+        double op_ns = (double)chrono::duration_cast<multi::nanoseconds>(applied - start).count() / (n - n / 10);
+        // Cancelled timers come back through the readyQueue, reset ones go back into the wheel
+        while (!run.commands.empty() || !run.readyQueue.empty() || !run.timeQueue.empty())
+            run.update();
+        run.update();
+        double settle_ms = chrono::duration<double, milli>(multi::Clock::now() - applied).count();
+        printf("  %-9s | create: %7.1f ns/timer | %s: %7.1f ns/timer | settled after %8.2f ms | objects in use: %zu\n", op.op, create_ns, op.op, op_ns,
+            settle_ms, run.getObjectCount());
+        report("timer_cancel", { { "op", op.op } }, { { "create_ns_per_timer", create_ns }, { "op_ns_per_timer", op_ns }, { "settle_ms", settle_ms },
+            { "objects_in_use", (double)run.getObjectCount() } });
+    }
+}
+// How late alarms fire, the time between an alarm's deadline and its callback. The runner is updated in a busy loop,
+// so this is the timer subsystem's jitter and not the scheduler's
+static multi::runner* jitter_run = nullptr;
+static std::vector<long long> lateness;
+template<typename T>
+void alarm_jitter(const char* unit, long long lo, long long hi, size_t count) {
+    using namespace std;
+    multi::runner run;
+    jitter_run = &run;
+    lateness.clear();
+    mt19937_64 rng(count);
+    for (size_t i = 0; i < count; i++)
+        run.setAlarm<T>(lo + (long long)(rng() % (hi - lo + 1)), [](multi::mobj* m) {
+            lateness.push_back(chrono::duration_cast<multi::nanoseconds>(multi::Clock::now() - jitter_run->getDeadline(m)).count());
+            return true;
+        });
+    while (lateness.size() < count)
+        run.update();
+    sort(lateness.begin(), lateness.end());
+    printf("  %-12s | %5zu alarms | p50: %9.2f us | p90: %9.2f us | p99: %9.2f us | max: %9.2f us\n", unit, count,
+        percentile(lateness, 50) / 1000.0, percentile(lateness, 90) / 1000.0, percentile(lateness, 99) / 1000.0, lateness.back() / 1000.0);
+    report("timer_jitter", { { "unit", unit } }, { { "p50_ns", (double)percentile(lateness, 50) }, { "p90_ns", (double)percentile(lateness, 90) },
+        { "p99_ns", (double)percentile(lateness, 99) }, { "max_ns", (double)lateness.back() } });
+}
+void bench_timer_jitter() {
+    std::cout << "Alarm lateness per time unit" << std::endl;
+    alarm_jitter<multi::microseconds>("microseconds", 50, 1000, 2000);
+    alarm_jitter<multi::milliseconds>("milliseconds", 1, 100, 1000);
+    alarm_jitter<multi::seconds>("seconds", 1, 2, 100);
+}
+// The period a tloop actually runs at. The timer is restarted when the tloop runs, so every late run also pushes back the next one
+static std::vector<long long> intervals;
+static multi::time last_tick;
+template<typename T>
+void tloop_accuracy(const char* label, long long period) {
+    using namespace std;
+    multi::runner run;
+    intervals.clear();
+    last_tick = multi::time();
+    run.newTLoop<T>(period, [](multi::mobj*) {
+        auto now = multi::Clock::now();
+        if (last_tick != multi::time())
+            intervals.push_back(chrono::duration_cast<multi::nanoseconds>(now - last_tick).count());
+        last_tick = now;
+        return true;
+    });
+    auto start = multi::Clock::now();
+    while (multi::Clock::now() - start < multi::milliseconds(500))
+        run.update();
+    long long expected = chrono::duration_cast<multi::nanoseconds>(T(period)).count();
+    double mean = 0;
+    for (auto i : intervals)
+        mean += i;
+    mean = intervals.empty() ? 0 : mean / intervals.size();
+    sort(intervals.begin(), intervals.end());
+    printf("  %-8s | %6zu runs | mean: %10.2f us | p50: %10.2f us | p99: %10.2f us | mean error: %+8.2f us\n", label, intervals.size(),
+        mean / 1000.0, percentile(intervals, 50) / 1000.0, percentile(intervals, 99) / 1000.0, (mean - expected) / 1000.0);
+    report("tloop_accuracy", { { "period", label } }, { { "runs", (double)intervals.size() }, { "mean_ns", mean },
+        { "p50_ns", (double)percentile(intervals, 50) }, { "p99_ns", (double)percentile(intervals, 99) }, { "mean_error_ns", mean - expected } });
+}
+void bench_tloop_accuracy() {
+    std::cout << "newTLoop period accuracy over 500ms" << std::endl;
+    tloop_accuracy<multi::microseconds>("100us", 100);
+    tloop_accuracy<multi::milliseconds>("1ms", 1);
+    tloop_accuracy<multi::milliseconds>("10ms", 10);
+}
+void bench_affinity() {
+    using namespace std;
+    cout << "Affinity calls on the current thread" << endl;
+    auto old = multi::GetAffinity();
+    uint32_t core = (uint32_t)old.first();
+    volatile uint32_t sink = 0;
+    double set_ns = measure([&] { multi::SetAffinityCore(core); }, multi::milliseconds(200));
+    double mask_ns = measure([&] { sink = sink + multi::GetAffinityMask(); }, multi::milliseconds(200));
+    double get_ns = measure([&] { sink = sink + (uint32_t)multi::GetAffinity().count(); }, multi::milliseconds(200));
+    multi::SetAffinity(old);
+    printf("  SetAffinityCore: %8.1f ns | GetAffinityMask: %8.1f ns | GetAffinity: %8.1f ns\n", set_ns, mask_ns, get_ns);
+    report("affinity", {}, { { "set_affinity_core_ns", set_ns }, { "get_affinity_mask_ns", mask_ns }, { "get_affinity_ns", get_ns } });
+}
+// Pairs of cpus to put a producer and a consumer on: two cores that share an L3, and two that do not. -1 leaves a thread unpinned
+struct cpu_pair {
+    const char* label;
+    int a;
+    int b;
+};
+std::vector<cpu_pair> cpu_pairs() {
+    auto& topo = multi::GetTopology();
+    std::vector<cpu_pair> pairs;
+    for (auto& l3 : topo.l3) {
+        // Two different physical cores in the same L3
+        std::vector<int> cores;
+        for (auto& core : topo.cores)
+            if ((core & l3) == core)
+                cores.push_back(core.first());
+        if (cores.size() >= 2) {
+            pairs.push_back({ "same_l3", cores[0], cores[1] });
+            break;
+        }
+    }
+    if (topo.l3.size() >= 2)
+        pairs.push_back({ "cross_l3", topo.l3[0].first(), topo.l3[1].first() });
+    if (pairs.empty())
+        pairs.push_back({ "unpinned", -1, -1 });
+    return pairs;
+}
+void pin(int cpu) {
+    if (cpu >= 0)
+        multi::SetAffinityCore((uint32_t)cpu);
+}
+// Spins a little before giving up the core, so the benchmarks also finish on machines with fewer cores than threads
+struct backoff {
+    int spins = 0;
+    void operator()() {
+        if (++spins > 64) {
+            spins = 0;
+            std::this_thread::yield();
+        }
+    }
+};
+template<typename Channel>
+double channel_throughput(const cpu_pair& pair, size_t producers, size_t total) {
+    Channel ch(1024);
+    size_t per = total / producers;
+    std::vector<std::thread> threads;
+    std::atomic<bool> go{ false };
+    for (size_t p = 0; p < producers; p++)
+        threads.emplace_back([&] {
+            pin(pair.a);
+            while (!go.load(std::memory_order_acquire));
+            backoff wait;
+            for (size_t i = 0; i < per; i++)
+                while (!ch.try_emplace(i))
+                    wait();
+        });
+    pin(pair.b);
+    auto start = multi::Clock::now();
+    go.store(true, std::memory_order_release);
+    size_t seen = 0, sum = 0;
+    backoff wait;
+    while (seen < per * producers) {
+        if (ch.consume([&](size_t& v) { sum += v; }))
+            seen++;
+        else
+            wait();
+    }
+    auto elapsed = multi::Clock::now() - start;
+    for (auto& t : threads)
+        t.join();
+    return (double)std::chrono::duration_cast<multi::nanoseconds>(elapsed).count() / seen;
+}
+double queue_throughput(const cpu_pair& pair, size_t total) {
+    multi::Queue<size_t> q;
+    std::thread producer([&] {
+        pin(pair.a);
+        for (size_t i = 0; i < total; i++)
+            q.push(i);
+    });
+    pin(pair.b);
+    auto start = multi::Clock::now();
+    size_t v;
+    for (size_t i = 0; i < total; i++)
+        while (!q.try_pop(v));
+    auto elapsed = multi::Clock::now() - start;
+    producer.join();
+    return (double)std::chrono::duration_cast<multi::nanoseconds>(elapsed).count() / total;
+}
+// Round trips through two spsc channels, half a round trip is the latency of one message
+std::vector<long long> channel_ping_pong(const cpu_pair& pair, size_t rounds) {
+    multi::spsc_channel<size_t> ping(64), pong(64);
+    std::thread echo([&] {
+        pin(pair.a);
+        backoff wait;
+        for (size_t i = 0; i < rounds; i++) {
+            while (!ping.consume([&](size_t& v) { pong.try_emplace(v); }))
+                wait();
+        }
+    });
+    pin(pair.b);
+    std::vector<long long> trips;
+    trips.reserve(rounds);
+    backoff wait;
+    for (size_t i = 0; i < rounds; i++) {
+        auto start = multi::Clock::now();
+        ping.try_emplace(i);
+        while (!pong.consume([](size_t&) {}))
+            wait();
+        trips.push_back(std::chrono::duration_cast<multi::nanoseconds>(multi::Clock::now() - start).count() / 2);
+    }
+    echo.join();
+    std::sort(trips.begin(), trips.end());
+    return trips;
+}
+void bench_channels() {
+    using namespace std;
+    cout << "Channel throughput and latency between two threads" << endl;
+    auto old = multi::GetAffinity();
+    const size_t total = 1 << 22;
+    for (auto& pair : cpu_pairs()) {
+        double spsc_ns = channel_throughput<multi::spsc_channel<size_t>>(pair, 1, total);
+        double queue_ns = queue_throughput(pair, total / 4);
+        auto trips = channel_ping_pong(pair, 20000);
+        printf("  %-8s (%3d -> %3d) | spsc: %6.1f ns/msg | Queue: %6.1f ns/msg | spsc latency p50: %8.1f ns p99: %8.1f ns\n", pair.label, pair.a, pair.b,
+            spsc_ns, queue_ns, (double)percentile(trips, 50), (double)percentile(trips, 99));
+        report("channels", { { "placement", pair.label }, { "kind", "spsc" } }, { { "ns_per_message", spsc_ns }, { "queue_ns_per_message", queue_ns },
+            { "latency_p50_ns", (double)percentile(trips, 50) }, { "latency_p99_ns", (double)percentile(trips, 99) } });
+        size_t counts[] = { 1, 2, 4 };
+        for (size_t producers : counts) {
+            double mpsc_ns = channel_throughput<multi::mpsc_channel<size_t>>(pair, producers, total);
+            printf("  %-8s (%3d -> %3d) | mpsc %zu producers: %6.1f ns/msg\n", pair.label, pair.a, pair.b, producers, mpsc_ns);
+            report("channels", { { "placement", pair.label }, { "kind", "mpsc" }, { "producers", to_string(producers) } }, { { "ns_per_message", mpsc_ns } });
+        }
+        multi::SetAffinity(old);
+    }
+}
+// One shot calls: runner::async against a newLoop that deactivates itself, and against std::async
+static size_t one_shots = 0;
+void bench_async() {
+    using namespace std;
+    cout << "One shot calls" << endl;
+    const size_t n = 100000;
+    multi::runner local;
+    vector<multi::mobj*> loops;
+    loops.reserve(n);
+    double loop_ns = measure([&] {
+        for (size_t i = 0; i < n; i++)
+            loops.push_back(local.newLoop([](multi::mobj*) {
+                one_shots++;
+                return true;
+            }));
+        local.update();
+        for (auto m : loops)
+            local.destroy(m);
+        loops.clear();
+        local.update();
+    }) / n;
+    vector<multi::future<size_t>> futures;
+    futures.reserve(n);
+    double async_ns = measure([&] {
+        for (size_t i = 0; i < n; i++)
+            futures.push_back(local.async([i] { return i; }));
+        local.update();
+        futures.clear();
+    }) / n;
+    printf("  same thread     | newLoop + destroy: %7.1f ns/call | async: %7.1f ns/call\n", loop_ns, async_ns);
+    report("async", { { "placement", "same_thread" } }, { { "loop_ns_per_call", loop_ns }, { "async_ns_per_call", async_ns } });
+
+    multi::runner threaded(true);
+    threaded.loop();
+    double cross_ns = measure([&] {
+        for (size_t i = 0; i < n; i++)
+            futures.push_back(threaded.async([i] { return i; }));
+        futures.back().wait();
+        futures.clear();
+    }) / n;
+    const size_t std_n = 2000;
+    vector<std::future<size_t>> std_futures;
+    double std_ns = measure([&] {
+        for (size_t i = 0; i < std_n; i++)
+            std_futures.push_back(std::async(std::launch::async, [i] { return i; }));
+        for (auto& f : std_futures)
+            f.wait();
+        std_futures.clear();
+    }) / std_n;
+    vector<long long> trips;
+    auto began = multi::Clock::now();
+    while (trips.size() < 20000 && multi::Clock::now() - began < multi::seconds(1)) {
+        auto start = multi::Clock::now();
+        threaded.async([] { return 1; }).get();
+        trips.push_back(chrono::duration_cast<multi::nanoseconds>(multi::Clock::now() - start).count());
+    }
+    sort(trips.begin(), trips.end());
+    printf("  other thread    | async: %7.1f ns/call | std::async: %9.1f ns/call | async().get() p50: %8.1f ns p99: %8.1f ns\n",
+        cross_ns, std_ns, (double)percentile(trips, 50), (double)percentile(trips, 99));
+    report("async", { { "placement", "other_thread" } }, { { "async_ns_per_call", cross_ns }, { "std_async_ns_per_call", std_ns },
+        { "round_trip_p50_ns", (double)percentile(trips, 50) }, { "round_trip_p99_ns", (double)percentile(trips, 99) } });
+}
+void bench_idle_policy() {
+    using namespace std;
+    cout << "Idle cpu use and wake up latency of a threaded runner per idle policy" << endl;
+    struct {
+        const char* name;
+        multi::idle_policy policy;
+    } policies[] = { { "spin", multi::idle_policy::spin() }, { "balanced", multi::idle_policy::balanced() }, { "sleep", multi::idle_policy::sleep() } };
+    for (auto& p : policies) {
+        multi::runner r(true);
+        r.setIdlePolicy(p.policy);
+        r.setAlarm<multi::seconds>(3600, [](multi::mobj*) { return true; }); // Far off, like most timers of a real runner
+        r.loop();
+        this_thread::sleep_for(multi::milliseconds(50));
+        clock_t cpu_start = clock();
+        auto start = multi::Clock::now();
+        this_thread::sleep_for(multi::milliseconds(500));
+        double wall = chrono::duration<double>(multi::Clock::now() - start).count();
+        double cpu = (double)(clock() - cpu_start) / CLOCKS_PER_SEC / wall * 100;
+        // Calls that come in 200us apart, the balanced policy is still spinning by then
+        vector<long long> latency;
+        for (int i = 0; i < 500; i++) {
+            auto posted = multi::Clock::now();
+            latency.push_back(r.async([posted] { return (long long)chrono::duration_cast<multi::nanoseconds>(multi::Clock::now() - posted).count(); }).get());
+            this_thread::sleep_for(multi::microseconds(200));
+        }
+        sort(latency.begin(), latency.end());
+        printf("  %-8s | idle cpu: %6.1f%% | wake up p50: %8.1f ns p99: %9.1f ns\n", p.name, cpu,
+            (double)percentile(latency, 50), (double)percentile(latency, 99));
+        report("idle_policy", { { "policy", p.name } }, { { "idle_cpu_percent", cpu },
+            { "wake_p50_ns", (double)percentile(latency, 50) }, { "wake_p99_ns", (double)percentile(latency, 99) } });
+    }
+    // A pool that only holds far off alarms, its workers keep them in their wheels and should park like an idle runner
+    {
+        multi::runner_pool pool;
+        for (int i = 0; i < 1000; i++)
+            pool.setAlarm<multi::seconds>(3600, [](multi::mobj*) { return true; });
+        this_thread::sleep_for(multi::milliseconds(50));
+        clock_t cpu_start = clock();
+        auto start = multi::Clock::now();
+        this_thread::sleep_for(multi::milliseconds(500));
+        double wall = chrono::duration<double>(multi::Clock::now() - start).count();
+        double cpu = (double)(clock() - cpu_start) / CLOCKS_PER_SEC / wall * 100 / pool.getWorkerCount();
+        printf("  pool of %zu with 1000 alarms | idle cpu per worker: %6.1f%%\n", pool.getWorkerCount(), cpu);
+        report("idle_policy", { { "policy", "pool_alarms" } }, { { "idle_cpu_percent", cpu } });
+    }
+}
+static const char* priority_name(multi::priority p) {
+    static const char* names[] = { "core", "very_high", "high", "above_normal", "normal", "below_normal", "low", "very_low", "idle" };
+    return names[(size_t)p];
+}
+// A 1ms tloop on a threaded runner that shares its cpu with a thread that never stops working, the os priorities decide who gets the cpu
+void os_priority(multi::priority latency, multi::priority bulk) {
+    using namespace std;
+    multi::thread_options options;
+    options.affinity.set(0);
+    options.loop = latency;
+    options.subsystem = latency; // The timers wake the loop, they have to get the cpu as well
+    atomic<bool> done{ false };
+    atomic<bool> bulk_exact{ true };
+    bool exact = true;
+    thread spinner([&] {
+        multi::cpu_set cpus;
+        cpus.set(0);
+        multi::SetAffinity(cpus);
+        bulk_exact = multi::SetOsPriority(bulk);
+        while (!done.load(memory_order_relaxed))
+            low_work = low_work + 1;
+    });
+    // The runner's threads do not say whether they got their priority, a throwaway thread asks for the same one
+    thread probe([&] { exact = multi::SetOsPriority(latency); });
+    probe.join();
+    intervals.clear();
+    last_tick = multi::time();
+    {
+        multi::runner run(true, -1, options);
+        run.newTLoop<multi::milliseconds>(1, [](multi::mobj*) {
+            auto now = multi::Clock::now();
+            if (last_tick != multi::time())
+                intervals.push_back(chrono::duration_cast<multi::nanoseconds>(now - last_tick).count());
+            last_tick = now;
+            return true;
+        });
+        run.loop();
+        this_thread::sleep_for(multi::milliseconds(500));
+    }
+    done = true;
+    spinner.join();
+    exact = exact && bulk_exact;
+    sort(intervals.begin(), intervals.end());
+    double p50 = intervals.empty() ? 0 : (double)percentile(intervals, 50);
+    double p99 = intervals.empty() ? 0 : (double)percentile(intervals, 99);
+    printf("  latency %-9s bulk %-9s%s | %5zu runs | p50: %10.2f us | p99: %10.2f us\n", priority_name(latency), priority_name(bulk),
+        exact ? "" : " (fallback)", intervals.size(), p50 / 1000.0, p99 / 1000.0);
+    report("os_priority", { { "latency", priority_name(latency) }, { "bulk", priority_name(bulk) }, { "exact", exact ? "true" : "false" } },
+        { { "runs", (double)intervals.size() }, { "p50_ns", p50 }, { "p99_ns", p99 } });
+}
+void bench_os_priority() {
+    std::cout << "1ms tloop period next to a busy thread on the same cpu per os priority" << std::endl;
+    os_priority(multi::priority::normal, multi::priority::normal);
+    os_priority(multi::priority::normal, multi::priority::very_low);
+    os_priority(multi::priority::normal, multi::priority::idle);
+    os_priority(multi::priority::very_high, multi::priority::normal);
+    os_priority(multi::priority::core, multi::priority::normal);
+}
+// What recording a run costs, only built in with -DMULTI_TRACE=ON. The trace of a threaded runner with a few timers is left in multi_trace.json
+void bench_trace() {
+    using namespace std;
+    cout << "Trace recording cost per run" << endl;
+#ifdef MULTI_TRACE
+    auto& log = multi::GetTraceLog();
+    for (size_t n : { 10, 1000, 100000 }) {
+        multi::runner run;
+        for (size_t i = 0; i < n; i++)
+            run.newLoop([](multi::mobj*) { return true; });
+        log.setEnabled(false);
+        double off_ns = measure([&] { run.update(); }) / n;
+        log.setEnabled(true);
+        double on_ns = measure([&] { run.update(); }) / n;
+        printf("  %8zu tasks | off: %8.2f ns/run | on: %8.2f ns/run | recording: %+8.2f ns/run\n", n, off_ns, on_ns, on_ns - off_ns);
+        report("trace", { { "tasks", to_string(n) } }, { { "off_ns_per_run", off_ns }, { "on_ns_per_run", on_ns }, { "recording_ns_per_run", on_ns - off_ns } });
+    }
+    log.clear();
+    {
+        multi::runner run(true);
+        for (int i = 0; i < 4; i++)
+            run.newTLoop<multi::milliseconds>(1 + i, [](multi::mobj*) { low_work = low_work + 1; return true; });
+        run.setAlarm<multi::milliseconds>(50, [](multi::mobj*) { return true; });
+        run.loop();
+        this_thread::sleep_for(multi::milliseconds(100));
+        auto start = multi::Clock::now();
+        multi::WriteTrace("multi_trace.json");
+        double write_ms = chrono::duration<double, milli>(multi::Clock::now() - start).count();
+        printf("  wrote multi_trace.json in %.2f ms while the runner kept going\n", write_ms);
+        report("trace", { { "tasks", "write" } }, { { "write_ms", write_ms } });
+    }
+#else
+    cout << "  Tracing is compiled out, configure with -DMULTI_TRACE=ON" << endl;
+#endif
+}
+#ifdef __cpp_impl_coroutine
+static size_t coroutine_steps = 0;
+multi::task stepper(multi::runner& run, size_t passes) {
+    for (size_t i = 0; i < passes; i++) {
+        coroutine_steps++;
+        co_await run.next_pass();
+    }
+}
+multi::task sleeper(multi::runner& run, size_t naps) {
+    for (size_t i = 0; i < naps; i++)
+        co_await run.sleep<multi::milliseconds>(1);
+}
+#endif
+// Only built in with C++20, see multi_bench20. The second round of tasks has to get every frame from the pool, nothing from the heap
+void bench_coroutines() {
+    using namespace std;
+    cout << "newTask with next_pass and sleep, frame reuse" << endl;
+#ifdef __cpp_impl_coroutine
+    multi::runner run;
+    const size_t tasks = 1000;
+    const size_t passes = 100;
+    size_t heap[2] = {};
+    double resume_ns = 0;
+    for (int round = 0; round < 2; round++) {
+        coroutine_steps = 0;
+        auto start = multi::Clock::now();
+        for (size_t i = 0; i < tasks; i++)
+            run.newTask(stepper(run, passes));
+        while (run.getTaskCount())
+            run.update();
+        resume_ns = (double)chrono::duration_cast<multi::nanoseconds>(multi::Clock::now() - start).count() / coroutine_steps;
+        heap[round] = run.getFrameAllocationCount();
+    }
+    bool reused = heap[1] == heap[0];
+    auto start = multi::Clock::now();
+    for (size_t i = 0; i < tasks; i++)
+        run.newTask(sleeper(run, 5));
+    while (run.getTaskCount())
+        run.update();
+    double sleep_ms = chrono::duration<double, milli>(multi::Clock::now() - start).count();
+    bool slept_reused = run.getFrameAllocationCount() <= heap[1] + 1; // The sleeper frame has its own size
+    printf("  %zu tasks x %zu passes | %7.1f ns/resume | heap frames: %zu then %zu%s\n", tasks, passes, resume_ns, heap[0], heap[1],
+        reused ? "" : " FRAMES NOT REUSED");
+    printf("  %zu tasks x 5 sleeps of 1ms | done after %7.2f ms | heap frames: %zu%s\n", tasks, sleep_ms, run.getFrameAllocationCount(),
+        slept_reused ? "" : " FRAMES NOT REUSED");
+    report("coroutines", {}, { { "resume_ns", resume_ns }, { "heap_frames_first_round", (double)heap[0] }, { "heap_frames_second_round", (double)heap[1] },
+        { "frames_reused", reused && slept_reused ? 1.0 : 0.0 }, { "sleep_done_ms", sleep_ms } });
+#else
+    cout << "  Coroutines need C++20, run multi_bench20" << endl;
+#endif
+}
+// Cuts [0, n) into one chunk per thread and starts a thread for every chunk, what parallel_for is up against
+template<typename F>
+void naive_parallel(size_t n, size_t threads, F f) {
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < threads; t++)
+        pool.emplace_back([&f, t, n, threads] { f(t, n * t / threads, n * (t + 1) / threads); });
+    for (auto& t : pool)
+        t.join();
+}
+inline uint64_t mix(uint64_t i) {
+    i *= 0x9E3779B97F4A7C15ULL;
+    return i ^ (i >> 29);
+}
+void bench_parallel() {
+    using namespace std;
+    cout << "Parallel algorithms against a thread per chunk" << endl;
+    multi::runner_pool pool;
+    size_t threads = pool.getWorkerCount() + 1; // The calling thread works along
+    auto add = [](uint64_t a, uint64_t b) { return a + b; };
+    vector<float> data;
+    for (size_t n : { 1000000ULL, 10000000ULL, 100000000ULL }) {
+        data.assign(n, 1.0f);
+        size_t runs = n >= 100000000 ? 1 : 3;
+        double pool_ns = measure([&] {
+            pool.parallel_for(0, n, [&](size_t i) { data[i] = data[i] * 1.0001f + 0.5f; });
+        }, multi::milliseconds(200), runs) / n;
+        double naive_ns = measure([&] {
+            naive_parallel(n, threads, [&](size_t, size_t lo, size_t hi) {
+                for (size_t i = lo; i < hi; i++)
+                    data[i] = data[i] * 1.0001f + 0.5f;
+            });
+        }, multi::milliseconds(200), runs) / n;
+        printf("  parallel_for    %10zu elements | pool: %6.3f ns/element | threads: %6.3f ns/element | speedup %5.2fx\n", n, pool_ns, naive_ns, naive_ns / pool_ns);
+        report("parallel", { { "algorithm", "for" }, { "elements", to_string(n) } },
+            { { "pool_ns_per_element", pool_ns }, { "naive_ns_per_element", naive_ns }, { "speedup", naive_ns / pool_ns } });
+    }
+    data.clear();
+    data.shrink_to_fit();
+    // Nothing in memory, only the work. skew makes the first quarter of the range 16 times as expensive, a chunk per thread can not even that out
+    for (size_t skew : { 1, 16 })
+        for (size_t n : { 1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL }) {
+            if (skew > 1 && n > 10000000)
+                break;
+            size_t runs = n >= 100000000 ? 1 : 3;
+            auto fold = [n, skew](uint64_t acc, size_t i) {
+                size_t reps = i < n / 4 ? skew : 1;
+                for (size_t r = 0; r < reps; r++)
+                    acc += mix(i + r);
+                return acc;
+            };
+            uint64_t pool_sum = 0, naive_sum = 0;
+            double pool_ns = measure([&] {
+                pool_sum = pool.parallel_reduce(0, n, (uint64_t)0, fold, add);
+            }, multi::milliseconds(200), runs) / n;
+            double naive_ns = measure([&] {
+                vector<uint64_t> partial(threads * 8, 0); // Spaced out so the threads don't share a cache line
+                naive_parallel(n, threads, [&](size_t t, size_t lo, size_t hi) {
+                    uint64_t acc = 0;
+                    for (size_t i = lo; i < hi; i++)
+                        acc = fold(acc, i);
+                    partial[t * 8] = acc;
+                });
+                naive_sum = 0;
+                for (size_t t = 0; t < threads; t++)
+                    naive_sum += partial[t * 8];
+            }, multi::milliseconds(200), runs) / n;
+            printf("  parallel_reduce %10zu elements skew %2zu | pool: %6.3f ns/element | threads: %6.3f ns/element | speedup %5.2fx%s\n",
+                n, skew, pool_ns, naive_ns, naive_ns / pool_ns, pool_sum == naive_sum ? "" : " MISMATCH");
+            report("parallel", { { "algorithm", "reduce" }, { "elements", to_string(n) }, { "skew", to_string(skew) } },
+                { { "pool_ns_per_element", pool_ns }, { "naive_ns_per_element", naive_ns }, { "speedup", naive_ns / pool_ns } });
+        }
+    vector<uint32_t> in(10000000), out(in.size());
+    for (size_t i = 0; i < in.size(); i++)
+        in[i] = (uint32_t)i;
+    double transform_ns = measure([&] {
+        pool.parallel_transform(in.begin(), in.end(), out.begin(), [](uint32_t x) { return (uint32_t)mix(x); });
+    }, multi::milliseconds(200)) / in.size();
+    double serial_ns = measure([&] {
+        transform(in.begin(), in.end(), out.begin(), [](uint32_t x) { return (uint32_t)mix(x); });
+    }, multi::milliseconds(200)) / in.size();
+    printf("  parallel_transform %7zu elements | pool: %6.3f ns/element | std::transform: %6.3f ns/element\n", in.size(), transform_ns, serial_ns);
+    report("parallel", { { "algorithm", "transform" }, { "elements", to_string(in.size()) } },
+        { { "pool_ns_per_element", transform_ns }, { "serial_ns_per_element", serial_ns } });
+}
+struct benchmark {
+    const char* name;
+    void (*run)();
+};
+static const benchmark benchmarks[] = {
+    { "timer_sweep", bench_timer_sweep },
+    { "timer_check", bench_timer_check },
+    { "clock_sources", bench_clock_sources },
+    { "queue_contention", bench_queue_contention },
+    { "object_churn", bench_object_churn },
+    { "priority_latency", bench_priority_latency },
+    { "round_robin_passes", bench_task_passes },
+    { "idle_alarms", bench_idle_alarms },
+    { "numa_passes", bench_numa_passes },
+    { "step_budget", bench_step_budget },
+    { "alarm_insert", bench_alarm_insert },
+    { "timer_cancel", bench_timer_cancel },
+    { "timer_jitter", bench_timer_jitter },
+    { "tloop_accuracy", bench_tloop_accuracy },
+    { "affinity", bench_affinity },
+    { "channels", bench_channels },
+    { "async", bench_async },
+    { "parallel", bench_parallel },
+    { "idle_policy", bench_idle_policy },
+    { "os_priority", bench_os_priority },
+    { "trace", bench_trace },
+    { "coroutines", bench_coroutines },
+};
+// multi_bench [--json file] [benchmark names...], runs every benchmark when no names are given. --json - writes to stdout
+int main(int argc, char** argv)
+{
+    const char* json = nullptr;
+    std::vector<std::string> only;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+            json = argv[++i];
+        else if (strcmp(argv[i], "--list") == 0) {
+            for (auto& b : benchmarks)
+                printf("%s\n", b.name);
+            return 0;
+        }
+        else
+            only.push_back(argv[i]);
+    }
+    for (auto& b : benchmarks)
+        if (only.empty() || std::find(only.begin(), only.end(), b.name) != only.end())
+            b.run();
+    if (json) {
+        FILE* f = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+        if (!f) {
+            fprintf(stderr, "Could not open %s\n", json);
+            return 1;
+        }
+        write_json(f);
+        if (f != stdout)
+            fclose(f);
+    }
+    return failures ? 1 : 0;
+}
@@ -1,7 +1,11 @@
 #include <iostream>
 #include "multi.h"
 #include <stdio.h>
+#include <string.h>
 #include <bitset>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
 
 // Part of the tests
 void do_tests() {
@@ -62,9 +66,402 @@ void do_tests() {
     }
     cout << "All Tests Finished!" << endl;
 }
-int main()
+// The runner tests check instead of print, every failed check is reported and makes main return 1
+static std::atomic<int> failures{ 0 };
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+void check(bool ok, const char* what, const char* file, int line) {
+    if (!ok) {
+        printf("  FAILED %s:%d: %s\n", file, line, what);
+        failures++;
+    }
+}
+// Updates run until done returns true, false if that took longer than a second
+template<typename F>
+bool update_until(multi::runner& run, F done) {
+    auto give_up = multi::Clock::now() + std::chrono::seconds(1);
+    while (!done()) {
+        if (multi::Clock::now() > give_up)
+            return false;
+        run.update();
+    }
+    return true;
+}
+// Waits until done returns true, false if that took longer than a second
+template<typename F>
+bool wait_until(F done) {
+    auto give_up = multi::Clock::now() + std::chrono::seconds(1);
+    while (!done()) {
+        if (multi::Clock::now() > give_up)
+            return false;
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return true;
+}
+void test_timer_wheel() {
+    using namespace std;
+    cout << "Timer wheel expiry order and cascading" << endl;
+    multi::time base = multi::Clock::now();
+    multi::timer_wheel wheel(base);
+    // Deadlines in microseconds on both sides of every level boundary, the last ones are further out than the top level
+    vector<long long> deadlines = { 0, 1, 2, 63, 64, 65, 4095, 4096, 4097, 100000, 262143, 262144, 262145, 16777215, 16777216,
+        1073741823, 1073741824, 68719476735LL, 68719476736LL, 5000000000000LL, 9000000000000LL };
+    vector<unique_ptr<multi::mobj>> objs;
+    for (size_t i = 0; i < deadlines.size(); i++) {
+        objs.emplace_back(new multi::mobj("timer"));
+        objs.back()->data = &deadlines[i];
+    }
+    // Filed in a scrambled order, plus some that are cancelled again
+    mt19937 rng(7);
+    vector<size_t> order(objs.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    shuffle(order.begin(), order.end(), rng);
+    for (size_t i : order)
+        wheel.insert(objs[i].get(), base + multi::microseconds(deadlines[i]));
+    vector<unique_ptr<multi::mobj>> cancelled;
+    for (long long d : { 5LL, 5000LL, 500000LL, 50000000000LL }) {
+        cancelled.emplace_back(new multi::mobj("cancelled"));
+        wheel.insert(cancelled.back().get(), base + multi::microseconds(d));
+    }
+    for (auto& m : cancelled)
+        CHECK(wheel.cancel(m.get()));
+    CHECK(wheel.size() == deadlines.size());
+    vector<long long> expired;
+    auto collect = [&](multi::mobj* m) {
+        if (m->data)
+            expired.push_back(*(long long*)m->data);
+        else
+            expired.push_back(-1); // A cancelled timer
+    };
+    for (long long d : deadlines) {
+        // Nothing may expire a tick early, and everything is due once the clock reaches its deadline
+        size_t before = expired.size();
+        if (d > 0)
+            wheel.advance(base + multi::microseconds(d - 1), collect);
+        CHECK(expired.size() == before);
+        wheel.advance(base + multi::microseconds(d), collect);
+        CHECK(expired.size() == before + 1);
+        CHECK(!expired.empty() && expired.back() == d);
+    }
+    CHECK(wheel.empty());
+    // A timer filed again from the callback expires on its new deadline
+    multi::mobj again("again");
+    multi::time now = base + multi::microseconds(deadlines.back());
+    wheel.insert(&again, now + multi::microseconds(10));
+    size_t runs = 0;
+    wheel.advance(now + multi::microseconds(10), [&](multi::mobj* m) {
+        runs++;
+        wheel.insert(m, now + multi::microseconds(5000));
+    });
+    CHECK(runs == 1);
+    wheel.advance(now + multi::microseconds(4999), [&](multi::mobj*) { runs++; });
+    CHECK(runs == 1);
+    wheel.advance(now + multi::microseconds(5000), [&](multi::mobj*) { runs++; });
+    CHECK(runs == 2);
+    // A deadline between two ticks is rounded up, it never expires early
+    multi::mobj fraction("fraction");
+    now += multi::microseconds(5000);
+    wheel.insert(&fraction, now + multi::nanoseconds(1500));
+    wheel.advance(now + multi::microseconds(1), [&](multi::mobj*) { runs++; });
+    CHECK(runs == 2);
+    wheel.advance(now + multi::microseconds(2), [&](multi::mobj*) { runs++; });
+    CHECK(runs == 3);
+}
+static std::atomic<int> alarm_fires[64];
+void test_timer_commands() {
+    using namespace std;
+    cout << "Cancel, reset and setPeriod racing with expiry" << endl;
+    multi::runner run;
+    size_t base = run.getObjectCount();
+    const int n = 64;
+    vector<multi::mobj*> alarms;
+    for (int i = 0; i < n; i++) {
+        alarm_fires[i] = 0;
+        alarms.push_back(run.setAlarm<multi::microseconds>(i % 8 * 10, [](multi::mobj* m) {
+            (*(atomic<int>*)m->data)++;
+            return true;
+        }));
+        alarms.back()->data = &alarm_fires[i];
+    }
+    // Every round changes every alarm while the subsystem is busy expiring them. A cancelled alarm must never fire again
+    mt19937 rng(11);
+    vector<bool> cancelled(n, false);
+    vector<int> seen(n, 0);
+    for (int round = 0; round < 2000; round++) {
+        for (int i = 0; i < n; i++) {
+            if (cancelled[i])
+                CHECK(alarm_fires[i] == seen[i]);
+            switch (rng() % 4) {
+            case 0:
+                run.cancel(alarms[i]);
+                cancelled[i] = true;
+                seen[i] = alarm_fires[i];
+                break;
+            case 1:
+                run.reset(alarms[i]);
+                cancelled[i] = false;
+                break;
+            case 2:
+                run.setPeriod<multi::microseconds>(alarms[i], rng() % 50);
+                break;
+            default:
+                break;
+            }
+        }
+        run.update();
+    }
+    for (int i = 0; i < n; i++)
+        if (cancelled[i])
+            CHECK(alarm_fires[i] == seen[i]);
+    // Reset with a short period, every one of them goes off again
+    for (int i = 0; i < n; i++) {
+        run.setPeriod<multi::microseconds>(alarms[i], 1);
+        run.reset(alarms[i]);
+        seen[i] = alarm_fires[i];
+    }
+    CHECK(update_until(run, [&] {
+        for (int i = 0; i < n; i++)
+            if (alarm_fires[i] == seen[i])
+                return false;
+        return true;
+    }));
+    // Pushed far out before the subsystem looked at it, then pulled back in
+    multi::mobj* late = run.setAlarm<multi::microseconds>(1, [](multi::mobj* m) {
+        (*(atomic<int>*)m->data)++;
+        return true;
+    });
+    atomic<int> late_fires{ 0 };
+    late->data = &late_fires;
+    run.setPeriod<multi::seconds>(late, 3600);
+    for (int i = 0; i < 100; i++)
+        run.update();
+    CHECK(late_fires == 0);
+    run.setPeriod<multi::microseconds>(late, 1);
+    CHECK(update_until(run, [&] { return late_fires == 1; }));
+    // Destroyed in every state, the memory of all of them comes back
+    for (int i = 0; i < n; i++)
+        if (rng() % 2)
+            run.reset(alarms[i]);
+    for (auto m : alarms)
+        run.destroy(m);
+    run.destroy(late);
+    CHECK(update_until(run, [&] { return run.getObjectCount() == base; }));
+}
+// The loops made by other threads find their counter here, their data can not be set before the runner may run them
+static std::mutex remote_lock;
+static std::unordered_map<multi::mobj*, std::atomic<size_t>*> remote_counters;
+static std::atomic<size_t> remote_runs{ 0 };
+void test_remote_objects() {
+    using namespace std;
+    cout << "Adding and destroying objects from other threads" << endl;
+    multi::runner run(true);
+    run.loop();
+    const size_t threads = 4, each = 500;
+    static atomic<size_t> ran[threads * each];
+    for (auto& r : ran)
+        r = 0;
+    vector<thread> makers;
+    for (size_t t = 0; t < threads; t++)
+        makers.emplace_back([&run, t] {
+            vector<multi::mobj*> mine;
+            for (size_t i = 0; i < each; i++) {
+                auto m = run.newLoop([](multi::mobj* m) {
+                    remote_runs++;
+                    lock_guard<mutex> lock(remote_lock);
+                    auto it = remote_counters.find(m);
+                    if (it != remote_counters.end())
+                        (*it->second)++;
+                    return true;
+                });
+                {
+                    lock_guard<mutex> lock(remote_lock);
+                    remote_counters[m] = &ran[t * each + i];
+                }
+                mine.push_back(m);
+            }
+            // Some are destroyed before the runner took them in, the rest once they ran
+            auto forget = [&](size_t i) {
+                run.destroy(mine[i]);
+                lock_guard<mutex> lock(remote_lock);
+                remote_counters.erase(mine[i]); // Its memory may come back as somebody else's loop
+            };
+            for (size_t i = 0; i < each; i += 2)
+                forget(i);
+            for (size_t i = 1; i < each; i += 2)
+                CHECK(wait_until([&] { return ran[t * each + i] > 0; }));
+            for (size_t i = 1; i < each; i += 2)
+                forget(i);
+        });
+    for (auto& t : makers)
+        t.join();
+    CHECK(wait_until([&] { return run.async([&run] { return run.getTaskCount(); }).get() == 0; }));
+    // Nothing runs once it is gone
+    size_t after = remote_runs;
+    run.async([] { return 0; }).get();
+    run.async([] { return 0; }).get();
+    CHECK(remote_runs == after);
+}
+static const uint64_t channel_messages = 200000;
+static std::atomic<uint64_t> spsc_received{ 0 };
+static bool spsc_in_order = true;
+static std::vector<uint8_t> mpsc_seen;
+static uint64_t mpsc_last[4];
+static bool mpsc_in_order = true;
+static std::atomic<uint64_t> mpsc_received{ 0 };
+void test_channels() {
+    using namespace std;
+    cout << "Channels deliver every message exactly once" << endl;
+    // The channels have to outlive the runner that receives from them
+    multi::spsc_channel<uint64_t> spsc(64);
+    multi::mpsc_channel<uint64_t> mpsc(64);
+    multi::runner run(true);
+    run.newReceiver(spsc, [](multi::mobj*, uint64_t& v) {
+        if (v != spsc_received.load(memory_order_relaxed))
+            spsc_in_order = false;
+        spsc_received.fetch_add(1, memory_order_release);
+        return true;
+    });
+    const uint64_t producers = 4;
+    mpsc_seen.assign(channel_messages * producers, 0);
+    for (auto& l : mpsc_last)
+        l = 0;
+    run.newReceiver(mpsc, [](multi::mobj*, uint64_t& v) {
+        uint64_t p = v / channel_messages, i = v % channel_messages;
+        if (i + 1 <= mpsc_last[p])
+            mpsc_in_order = false; // Every producer's messages arrive in the order it sent them
+        mpsc_last[p] = i + 1;
+        mpsc_seen[v]++;
+        mpsc_received.fetch_add(1, memory_order_release);
+        return true;
+    });
+    run.loop();
+    thread single([&] {
+        for (uint64_t i = 0; i < channel_messages; i++)
+            while (!spsc.try_send(uint64_t(i)))
+                this_thread::yield();
+    });
+    vector<thread> many;
+    for (uint64_t p = 0; p < producers; p++)
+        many.emplace_back([&, p] {
+            for (uint64_t i = 0; i < channel_messages; i++)
+                while (!mpsc.try_send(p * channel_messages + i))
+                    this_thread::yield();
+        });
+    single.join();
+    for (auto& t : many)
+        t.join();
+    CHECK(wait_until([] { return spsc_received == channel_messages; }));
+    CHECK(wait_until([&] { return mpsc_received == channel_messages * producers; }));
+    this_thread::sleep_for(chrono::milliseconds(10)); // Nothing more may come
+    CHECK(spsc_received == channel_messages);
+    CHECK(spsc_in_order);
+    CHECK(mpsc_received == channel_messages * producers);
+    CHECK(mpsc_in_order);
+    CHECK(find_if(mpsc_seen.begin(), mpsc_seen.end(), [](uint8_t c) { return c != 1; }) == mpsc_seen.end());
+}
+static int shared_value = 21;
+void test_futures() {
+    using namespace std;
+    cout << "Futures and then chains" << endl;
+    multi::runner run(true);
+    run.loop();
+    multi::runner_pool pool(false, 2);
+    CHECK(run.async([] { return 20; }).then([](int& v) { return v + 1; }).then(pool, [](int& v) { return v * 2; }).get() == 42);
+    // Chains hop back and forth between the runner and the pool, and a void call passes nothing on
+    atomic<int> steps{ 0 };
+    auto chain = pool.async([&] { steps++; })
+        .then(run, [&] { steps++; return string("multi"); })
+        .then(pool, [&](string& s) { steps++; return s.size(); })
+        .then([&](size_t& n) { steps++; return (int)n; });
+    CHECK(chain.get() == 5);
+    CHECK(steps == 4);
+    // then() on a call that is done already runs right away
+    auto done = run.async([] { return 1; });
+    done.wait();
+    CHECK(done.then([](int& v) { return v + 1; }).get() == 2);
+    // Many calls from many threads, every result comes back to the one who asked
+    vector<thread> callers;
+    atomic<int> wrong{ 0 };
+    for (int t = 0; t < 4; t++)
+        callers.emplace_back([&, t] {
+            for (int i = 0; i < 1000; i++) {
+                auto f = (i % 2 ? run.async([=] { return t * 1000 + i; }) : pool.async([=] { return t * 1000 + i; }));
+                if (f.then([](int& v) { return v + 1; }).get() != t * 1000 + i + 1)
+                    wrong++;
+            }
+        });
+    for (auto& t : callers)
+        t.join();
+    CHECK(wrong == 0);
+    // A call that throws hands the exception to get() and down the chain, the runner keeps going
+    bool caught = false;
+    try {
+        run.async([]() -> int { throw runtime_error("boom"); }).then([](int& v) { return v + 1; }).get();
+    }
+    catch (runtime_error& e) {
+        caught = strcmp(e.what(), "boom") == 0;
+    }
+    CHECK(caught);
+    CHECK(run.async([] { return 7; }).get() == 7);
+    // A reference result refers to the original
+    CHECK(&run.async([]() -> int& { return shared_value; }).get() == &shared_value);
+}
+static size_t bulk_runs = 0, urgent_runs = 0, mover_runs = 0;
+static multi::runner* moving_runner = nullptr;
+void test_priority_moves() {
+    using namespace std;
+    cout << "Moving tasks between priority levels" << endl;
+    multi::runner run;
+    run.setScheme(multi::scheduler::priority);
+    moving_runner = &run;
+    for (int i = 0; i < 10000; i++)
+        run.setPriority(run.newLoop([](multi::mobj*) { bulk_runs++; return true; }), multi::priority::low);
+    auto urgent = run.newLoop([](multi::mobj*) { urgent_runs++; return true; });
+    run.setPriority(urgent, multi::priority::very_low);
+    run.update();
+    CHECK(bulk_runs == 10000);
+    CHECK(urgent_runs == 0); // Only gets a quarter of a share behind the bulk
+    // Another thread only hands the move over, the runner files it at the start of the next pass
+    thread([&run, urgent] { run.setPriority(urgent, multi::priority::very_high); }).join();
+    CHECK(urgent->getPriority() == multi::priority::very_low);
+    run.update();
+    CHECK(urgent_runs == 1);
+    CHECK(urgent->getPriority() == multi::priority::very_high);
+    // A task that moves itself below its level during a pass is not run again by the same pass
+    auto mover = run.newLoop([](multi::mobj* m) {
+        mover_runs++;
+        moving_runner->setPriority(m, multi::priority::idle);
+        return true;
+    });
+    run.setPriority(mover, multi::priority::very_high);
+    run.update();
+    CHECK(mover_runs == 1);
+    CHECK(mover->getPriority() == multi::priority::very_high);
+    run.update();
+    CHECK(mover->getPriority() == multi::priority::idle);
+    run.destroy(mover);
+    run.destroy(urgent);
+    CHECK(update_until(run, [&] { return run.getTaskCount() == 10000; }));
+    moving_runner = nullptr;
+}
+void run_tests() {
+    test_timer_wheel();
+    test_timer_commands();
+    test_remote_objects();
+    test_channels();
+    test_futures();
+    test_priority_moves();
+    if (failures)
+        printf("%d checks failed\n", failures.load());
+    else
+        printf("All runner tests passed\n");
+}
+// multi_tests runs every test, multi_tests runner leaves out the affinity tests which need at least two cores
+int main(int argc, char** argv)
 {
-    do_tests();
+    if (argc < 2 || strcmp(argv[1], "runner") != 0)
+        do_tests();
+    run_tests();
 
     /*multi::tStatus test{ multi::STATUS_ERRORED };
     std::cout << "SizeOf: " << sizeof(test) << std::endl;
@@ -86,5 +483,5 @@ int main()
     //// If another thread is pushed you must hold the main thread still!
     //while (true);
 
-
+    return failures ? 1 : 0;
 }
@@ -6,17 +6,43 @@
 #include <sys/sysctl.h>
 #else
 #include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
 #endif
 #include <stdint.h>
+#include <string.h>
+#include <cmath>
+#include <string>
 #include <bitset>
 #include <chrono>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <queue>
 #include <condition_variable>
 #include <list>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <new>
 #include <type_traits>
+#include <optional>
+#include <exception>
 #include <stdio.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef __cpp_impl_coroutine
+#include <coroutine>
+#endif
 
 namespace multi {
 	// Capture this when code is loaded up!
@@ -26,6 +52,9 @@ namespace multi {
 		return mainThreadID == std::this_thread::get_id();
 	}
 	class runner;
+	class timer_wheel;
+	class runner_pool;
+	class task_table;
 	struct mobj;
 	struct tHandle {
 		void* handle = nullptr; // On windows this is a HANDLE object, On Linux this is a pthread
@@ -33,6 +62,44 @@ namespace multi {
 			handle = hand;
 		}
 	};
+	/// <summary>
+	/// Returns the index of the lowest set bit, v must not be 0
+	/// </summary>
+	inline int lowest_bit(uint64_t v) {
+#ifdef _MSC_VER
+		unsigned long i;
+#ifdef _WIN64
+		_BitScanForward64(&i, v);
+		return (int)i;
+#else
+		if (_BitScanForward(&i, (unsigned long)v))
+			return (int)i;
+		_BitScanForward(&i, (unsigned long)(v >> 32));
+		return (int)i + 32;
+#endif
+#else
+		return __builtin_ctzll(v);
+#endif
+	}
+	/// <summary>
+	/// Returns the index of the highest set bit, v must not be 0
+	/// </summary>
+	inline int highest_bit(uint64_t v) {
+#ifdef _MSC_VER
+		unsigned long i;
+#ifdef _WIN64
+		_BitScanReverse64(&i, v);
+		return (int)i;
+#else
+		if (_BitScanReverse(&i, (unsigned long)(v >> 32)))
+			return (int)i + 32;
+		_BitScanReverse(&i, (unsigned long)v);
+		return (int)i;
+#endif
+#else
+		return 63 - __builtin_clzll(v);
+#endif
+	}
 	const uint8_t STATUS_STOPPED = 0;
 	const uint8_t STATUS_RUNNING = 1;
 	const uint8_t STATUS_YIELDING = 2;
@@ -41,7 +108,229 @@ namespace multi {
 		uint8_t active : 2;
 		uint8_t stop : 1;
 	};
-#ifdef _WIN32 || _WIN64
+	/// <summary>
+	/// A set of logical cpus. Unlike a plain mask it is not limited to 32 or 64 cpus
+	/// </summary>
+	class cpu_set {
+	public:
+		cpu_set() = default;
+		// Builds a set from the classic mask where bit n is cpu n
+		explicit cpu_set(uint64_t mask) {
+			if (mask)
+				bits.push_back(mask);
+		}
+		void set(uint32_t cpu, bool value = true) {
+			size_t w = cpu / 64;
+			if (w >= bits.size()) {
+				if (!value)
+					return;
+				bits.resize(w + 1, 0);
+			}
+			if (value)
+				bits[w] |= 1ULL << (cpu % 64);
+			else
+				bits[w] &= ~(1ULL << (cpu % 64));
+			trim();
+		}
+		bool test(uint32_t cpu) const {
+			size_t w = cpu / 64;
+			return w < bits.size() && (bits[w] >> (cpu % 64)) & 1;
+		}
+		void clear() {
+			bits.clear();
+		}
+		bool empty() const {
+			return bits.empty();
+		}
+		size_t count() const {
+			size_t c = 0;
+			for (auto w : bits)
+				for (; w; w &= w - 1)
+					c++;
+			return c;
+		}
+		// The lowest cpu in the set, -1 if empty
+		int first() const {
+			return next(-1);
+		}
+		// The lowest cpu in the set after the given one, -1 if there is none
+		int next(int after) const {
+			uint32_t cpu = (uint32_t)(after + 1);
+			for (size_t w = cpu / 64; w < bits.size(); w++) {
+				uint64_t word = bits[w];
+				if (w == cpu / 64)
+					word &= ~0ULL << (cpu % 64);
+				if (word)
+					return (int)(w * 64 + lowest_bit(word));
+			}
+			return -1;
+		}
+		// One past the highest cpu that can be in the set
+		uint32_t width() const {
+			return (uint32_t)(bits.size() * 64);
+		}
+		// The cpus 64 * i up to 64 * i + 63 as a mask
+		uint64_t word(size_t i) const {
+			return i < bits.size() ? bits[i] : 0;
+		}
+		std::vector<uint32_t> list() const {
+			std::vector<uint32_t> l;
+			for (int c = first(); c >= 0; c = next(c))
+				l.push_back((uint32_t)c);
+			return l;
+		}
+		cpu_set& operator|=(const cpu_set& o) {
+			if (o.bits.size() > bits.size())
+				bits.resize(o.bits.size(), 0);
+			for (size_t i = 0; i < o.bits.size(); i++)
+				bits[i] |= o.bits[i];
+			return *this;
+		}
+		cpu_set& operator&=(const cpu_set& o) {
+			if (bits.size() > o.bits.size())
+				bits.resize(o.bits.size());
+			for (size_t i = 0; i < bits.size(); i++)
+				bits[i] &= o.bits[i];
+			trim();
+			return *this;
+		}
+		cpu_set operator|(const cpu_set& o) const {
+			cpu_set r = *this;
+			return r |= o;
+		}
+		cpu_set operator&(const cpu_set& o) const {
+			cpu_set r = *this;
+			return r &= o;
+		}
+		bool operator==(const cpu_set& o) const {
+			return bits == o.bits;
+		}
+		bool operator!=(const cpu_set& o) const {
+			return bits != o.bits;
+		}
+	private:
+		void trim() {
+			while (!bits.empty() && bits.back() == 0)
+				bits.pop_back();
+		}
+		std::vector<uint64_t> bits;
+	};
+	/// <summary>
+	/// Parses a cpu list the way linux writes them, like "0-3,8,10-11"
+	/// </summary>
+	inline cpu_set ParseCpuList(const char* str) {
+		cpu_set set;
+		while (*str) {
+			char* end;
+			unsigned long a = strtoul(str, &end, 10);
+			if (end == str) {
+				str++; // Skip separators and whitespace
+				continue;
+			}
+			unsigned long b = a;
+			str = end;
+			if (*str == '-') {
+				b = strtoul(str + 1, &end, 10);
+				str = end;
+			}
+			for (unsigned long c = a; c <= b; c++)
+				set.set((uint32_t)c);
+		}
+		return set;
+	}
+	/// <summary>
+	/// How the logical cpus of the machine are laid out. Every list holds one set of cpus per physical core, package, shared cache or numa node
+	/// </summary>
+	struct cpu_topology {
+		struct cpu {
+			uint32_t id;
+			uint32_t core; // Index into cores
+			uint32_t package; // Index into packages
+			uint32_t node; // Numa node id
+		};
+		std::vector<cpu> cpus; // Online logical cpus, sorted by id
+		std::vector<cpu_set> cores; // The SMT siblings of each physical core
+		std::vector<cpu_set> packages; // The cpus of each socket
+		std::vector<cpu_set> l2; // Cpus that share an L2 cache
+		std::vector<cpu_set> l3; // Cpus that share an L3 cache
+		std::vector<cpu_set> nodes; // Indexed by numa node id, nodes without cpus are empty
+		size_t getLogicalCoreCount() const {
+			return cpus.size();
+		}
+		size_t getPhysicalCoreCount() const {
+			return cores.size();
+		}
+		size_t getNodeCount() const {
+			return nodes.size();
+		}
+		// nullptr if the cpu is not online
+		const cpu* find(uint32_t id) const {
+			auto it = std::lower_bound(cpus.begin(), cpus.end(), id, [](const cpu& c, uint32_t id) { return c.id < id; });
+			return it != cpus.end() && it->id == id ? &*it : nullptr;
+		}
+		// The numa node of a cpu, 0 if it is unknown
+		uint32_t nodeOf(uint32_t id) const {
+			auto c = find(id);
+			return c ? c->node : 0;
+		}
+		// Every online cpu
+		cpu_set all() const {
+			cpu_set s;
+			for (auto& c : cpus)
+				s.set(c.id);
+			return s;
+		}
+		// One cpu of every physical core, so nothing that is pinned to them shares a core
+		cpu_set firstSiblings() const {
+			cpu_set s;
+			for (auto& c : cores)
+				s.set((uint32_t)c.first());
+			return s;
+		}
+	};
+	// Adds a set to a list of sets unless it is empty or already in there
+	inline void addUniqueSet(std::vector<cpu_set>& sets, const cpu_set& set) {
+		if (set.empty())
+			return;
+		for (auto& s : sets)
+			if (s == set)
+				return;
+		sets.push_back(set);
+	}
+	// Fills in the per cpu view from the core, package and node sets
+	inline void finishTopology(cpu_topology& topo) {
+		if (topo.nodes.empty()) {
+			cpu_set all;
+			for (auto& c : topo.cores)
+				all |= c;
+			topo.nodes.push_back(all);
+		}
+		if (topo.packages.empty())
+			topo.packages.push_back(topo.nodes[0]);
+		topo.cpus.clear();
+		for (uint32_t core = 0; core < topo.cores.size(); core++) {
+			for (int id = topo.cores[core].first(); id >= 0; id = topo.cores[core].next(id)) {
+				cpu_topology::cpu c = { (uint32_t)id, core, 0, 0 };
+				for (uint32_t p = 0; p < topo.packages.size(); p++)
+					if (topo.packages[p].test(id))
+						c.package = p;
+				for (uint32_t n = 0; n < topo.nodes.size(); n++)
+					if (topo.nodes[n].test(id))
+						c.node = n;
+				topo.cpus.push_back(c);
+			}
+		}
+		std::sort(topo.cpus.begin(), topo.cpus.end(), [](const cpu_topology::cpu& a, const cpu_topology::cpu& b) { return a.id < b.id; });
+	}
+	inline cpu_topology ReadTopology();
+	/// <summary>
+	/// The topology of the machine, read once and then cached
+	/// </summary>
+	inline const cpu_topology& GetTopology() {
+		static const cpu_topology topo = ReadTopology();
+		return topo;
+	}
+#if defined(_WIN32) || defined(_WIN64)
 	uint32_t GetLogicalCoreCount() {
 		return std::thread::hardware_concurrency();
 	}
@@ -206,79 +495,439 @@ namespace multi {
 		return -1;
 	}
 
-#elif __unix || __unix__
-	// Unable to currently test!
-#error Unsupported platform
-#elif __APPLE__ || __MACH__
-	// Unable to currently test!
-#error Unsupported platform
+	// The cpus in a processor group mask
+	inline cpu_set GroupMaskToSet(const GROUP_AFFINITY& g) {
+		const int groupBits = sizeof(KAFFINITY) * 8;
+		cpu_set s;
+		for (int b = 0; b < groupBits; b++)
+			if (g.Mask & ((KAFFINITY)1 << b))
+				s.set(g.Group * groupBits + b);
+		return s;
+	}
+	inline cpu_topology ReadTopology() {
+		cpu_topology topo;
+		DWORD length = 0;
+		GetLogicalProcessorInformationEx(RelationAll, nullptr, &length);
+		if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+			return topo;
+		std::vector<char> buffer(length);
+		if (!GetLogicalProcessorInformationEx(RelationAll, (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)buffer.data(), &length))
+			return topo;
+		for (DWORD offset = 0; offset < length;) {
+			auto ptr = (PSYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX)(buffer.data() + offset);
+			switch (ptr->Relationship)
+			{
+			case RelationProcessorCore:
+			case RelationProcessorPackage:
+			{
+				cpu_set c;
+				for (WORD g = 0; g < ptr->Processor.GroupCount; g++)
+					c |= GroupMaskToSet(ptr->Processor.GroupMask[g]);
+				if (ptr->Relationship == RelationProcessorCore)
+					topo.cores.push_back(c);
+				else
+					topo.packages.push_back(c);
+				break;
+			}
+			case RelationCache:
+				if (ptr->Cache.Type != CacheInstruction) {
+					if (ptr->Cache.Level == 2)
+						addUniqueSet(topo.l2, GroupMaskToSet(ptr->Cache.GroupMask));
+					if (ptr->Cache.Level == 3)
+						addUniqueSet(topo.l3, GroupMaskToSet(ptr->Cache.GroupMask));
+				}
+				break;
+			case RelationNumaNode:
+			{
+				DWORD n = ptr->NumaNode.NodeNumber;
+				if (topo.nodes.size() <= n)
+					topo.nodes.resize(n + 1);
+				topo.nodes[n] |= GroupMaskToSet(ptr->NumaNode.GroupMask);
+				break;
+			}
+			default:
+				break;
+			}
+			offset += ptr->Size;
+		}
+		finishTopology(topo);
+		return topo;
+	}
+	/// <summary>
+	/// Sets the affinity of a thread to any set of cpus. Windows keeps a thread in one processor group, so every cpu has to be in the same group
+	/// </summary>
+	inline bool SetAffinity(const cpu_set& cpus, tHandle* hand = nullptr) {
+		const int groupBits = sizeof(KAFFINITY) * 8;
+		int first = cpus.first();
+		if (first < 0)
+			return false;
+		GROUP_AFFINITY g = {};
+		g.Group = (WORD)(first / groupBits);
+		for (int c = first; c >= 0; c = cpus.next(c)) {
+			if (c / groupBits != g.Group)
+				return false;
+			g.Mask |= (KAFFINITY)1 << (c % groupBits);
+		}
+		return SetThreadGroupAffinity(hand ? hand->handle : GetCurrentThread(), &g, nullptr) != 0;
+	}
+	/// <summary>
+	/// Gets the set of cpus a thread may run on
+	/// </summary>
+	inline cpu_set GetAffinity(tHandle* hand = nullptr) {
+		GROUP_AFFINITY g = {};
+		if (!GetThreadGroupAffinity(hand ? hand->handle : GetCurrentThread(), &g))
+			return cpu_set();
+		return GroupMaskToSet(g);
+	}
+	/// <summary>
+	/// Gets the numa node of the cpu the calling thread is running on
+	/// </summary>
+	inline int GetCurrentNode() {
+		PROCESSOR_NUMBER number;
+		GetCurrentProcessorNumberEx(&number);
+		USHORT node = 0;
+		if (!GetNumaProcessorNodeEx(&number, &node))
+			return 0;
+		return node;
+	}
+	/// <summary>
+	/// Allocates whole pages that prefer the memory of a numa node, node -1 leaves it up to the os. Free them with FreeOnNode
+	/// </summary>
+	inline void* AllocateOnNode(size_t bytes, int node) {
+		void* p;
+		if (node < 0)
+			p = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		else
+			p = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD)node);
+		if (!p)
+			throw std::bad_alloc();
+		return p;
+	}
+	inline void FreeOnNode(void* p, size_t bytes) {
+		VirtualFree(p, 0, MEM_RELEASE);
+	}
 #elif __linux__
-	// All code is currently untested!
-	#include <pthread.h>
-	#include <stdio.h>
-	#include <stdlib.h>
+	static_assert(sizeof(pthread_t) <= sizeof(void*), "A pthread_t has to fit in a tHandle");
+	inline void* PthreadToHandle(pthread_t t) {
+		void* h = nullptr;
+		memcpy(&h, &t, sizeof(t));
+		return h;
+	}
+	inline pthread_t HandleToPthread(void* h) {
+		pthread_t t;
+		memcpy(&t, &h, sizeof(t));
+		return t;
+	}
+	inline pthread_t ThreadOf(tHandle* hand) {
+		return hand ? HandleToPthread(hand->handle) : pthread_self();
+	}
+	// Reads a whole (small) file, used for sysfs
+	inline bool ReadSysFile(const std::string& path, std::string& out) {
+		FILE* f = fopen(path.c_str(), "r");
+		if (!f)
+			return false;
+		char buf[4096];
+		out.clear();
+		size_t n;
+		while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+			out.append(buf, n);
+		fclose(f);
+		return true;
+	}
+	inline long ReadSysNumber(const std::string& path, long fallback) {
+		std::string s;
+		if (!ReadSysFile(path, s))
+			return fallback;
+		char* end;
+		long v = strtol(s.c_str(), &end, 10);
+		return end == s.c_str() ? fallback : v;
+	}
+	/// <summary>
+	/// Reads the topology from /sys/devices/system/cpu and /sys/devices/system/node
+	/// </summary>
+	inline cpu_topology ReadTopology() {
+		cpu_topology topo;
+		std::string s;
+		cpu_set online;
+		if (ReadSysFile("/sys/devices/system/cpu/online", s))
+			online = ParseCpuList(s.c_str());
+		if (online.empty())
+			for (uint32_t i = 0; i < processor_count; i++)
+				online.set(i);
+		for (int c = online.first(); c >= 0; c = online.next(c)) {
+			std::string base = "/sys/devices/system/cpu/cpu" + std::to_string(c);
+			cpu_set siblings;
+			if (ReadSysFile(base + "/topology/thread_siblings_list", s))
+				siblings = ParseCpuList(s.c_str()) & online;
+			if (siblings.empty())
+				siblings.set(c);
+			addUniqueSet(topo.cores, siblings);
+			if (ReadSysFile(base + "/topology/package_cpus_list", s) || ReadSysFile(base + "/topology/core_siblings_list", s))
+				addUniqueSet(topo.packages, ParseCpuList(s.c_str()) & online);
+			for (int index = 0;; index++) {
+				std::string cache = base + "/cache/index" + std::to_string(index);
+				long level = ReadSysNumber(cache + "/level", -1);
+				if (level < 0)
+					break;
+				if (ReadSysFile(cache + "/type", s) && s.compare(0, 11, "Instruction") == 0)
+					continue;
+				if ((level == 2 || level == 3) && ReadSysFile(cache + "/shared_cpu_list", s))
+					addUniqueSet(level == 2 ? topo.l2 : topo.l3, ParseCpuList(s.c_str()) & online);
+			}
+		}
+		cpu_set nodes;
+		if (ReadSysFile("/sys/devices/system/node/online", s))
+			nodes = ParseCpuList(s.c_str()); // Same list format
+		for (int n = nodes.first(); n >= 0; n = nodes.next(n)) {
+			if (topo.nodes.size() <= (size_t)n)
+				topo.nodes.resize(n + 1);
+			if (ReadSysFile("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist", s))
+				topo.nodes[n] = ParseCpuList(s.c_str()) & online;
+		}
+		finishTopology(topo);
+		return topo;
+	}
 	uint32_t GetLogicalCoreCount() {
 		return std::thread::hardware_concurrency();
 	}
+	/// <summary>
+	/// Get the physical core count of the cpu! Does not include logical cpus
+	/// </summary>
+	/// <returns>Number of physical cores</returns>
 	uint32_t GetPhysicalCoreCount() {
-		auto file = *popen("lscpu -p=cpu,core", "rb");
+		return (uint32_t)GetTopology().getPhysicalCoreCount();
 	}
+	/// <summary>
+	/// Gets a handle to a thread
+	/// </summary>
+	/// <returns>A handle to a thread</returns>
 	tHandle* GetThreadHandle() {
-		tHandle* hand;
-		hand->handle = &pthread_self();
+		tHandle* hand = new tHandle;
+		hand->setHandle(PthreadToHandle(pthread_self()));
 		return hand;
 	}
-	bool SetAffinityCore(uint32_t core, tHandle* hand = nullptr) {
-		hand = hand ? hand : GetThreadHandle();
-		if (core > processor_count || core < 0)
-			return false; // This is a non existing core!
-		cpu_set_t cpuset;
-		pthread_t thread = *((pthread_t*)hand->handle);
-		CPU_ZERO(&cpuset);
-		CPU_SET(core, &cpuset);
-		return pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset) == 0;
+	/// <summary>
+	/// Get's a raw handle to a thread
+	/// </summary>
+	void* GetThreadHandle(bool b) {
+		return PthreadToHandle(pthread_self());
 	}
-	bool SetAffinityMask(uint32_t mask, tHandle * hand = nullptr) {
-		hand = hand ? hand : GetThreadHandle();
-		cpu_set_t cpuset;
-		CPU_ZERO(&cpuset);
-		CPU_SET(processor_count, &cpuset);
-		if (cpuset < mask)
+	/// <summary>
+	/// Converts a raw handle to a thandle
+	/// </summary>
+	tHandle* GetThreadHandle(void* hand) {
+		tHandle* h = new tHandle;
+		h->setHandle(hand);
+		return h;
+	}
+	/// <summary>
+	/// Sets the affinity of a thread to any set of cpus, there is no limit on the number of cpus
+	/// </summary>
+	/// <returns> Success if affinity could be set</returns>
+	inline bool SetAffinity(const cpu_set& cpus, tHandle* hand = nullptr) {
+		if (cpus.empty())
 			return false;
-		cpuset = mask;
-		pthread_t thread = *((pthread_t*)hand->handle);
-		return pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset) == 0;
+		size_t n = cpus.width() > CPU_SETSIZE ? cpus.width() : CPU_SETSIZE;
+		cpu_set_t* set = CPU_ALLOC(n);
+		size_t bytes = CPU_ALLOC_SIZE(n);
+		CPU_ZERO_S(bytes, set);
+		for (int c = cpus.first(); c >= 0; c = cpus.next(c))
+			CPU_SET_S(c, bytes, set);
+		bool ok = pthread_setaffinity_np(ThreadOf(hand), bytes, set) == 0;
+		CPU_FREE(set);
+		return ok;
 	}
 	/// <summary>
-	/// Gets the affinity mask of the currently running thread!
+	/// Gets the set of cpus a thread may run on
+	/// </summary>
+	inline cpu_set GetAffinity(tHandle* hand = nullptr) {
+		cpu_set out;
+		// The kernel refuses masks that are smaller than its own, keep growing until it fits
+		for (size_t n = CPU_SETSIZE; n <= (1u << 20); n *= 2) {
+			cpu_set_t* set = CPU_ALLOC(n);
+			size_t bytes = CPU_ALLOC_SIZE(n);
+			CPU_ZERO_S(bytes, set);
+			int r = pthread_getaffinity_np(ThreadOf(hand), bytes, set);
+			if (r == 0)
+				for (size_t c = 0; c < n; c++)
+					if (CPU_ISSET_S(c, bytes, set))
+						out.set((uint32_t)c);
+			CPU_FREE(set);
+			if (r != EINVAL)
+				break;
+		}
+		return out;
+	}
+	/// <summary>
+	/// Use this function within the thread itself, or pass a handle to another thread.
+	/// </summary>
+	/// <param name="core"> The logical cpu you want the thread to run on.</param>
+	/// <returns> Success if affinity could be set</returns>
+	bool SetAffinityCore(uint32_t core, tHandle* hand = nullptr) {
+		cpu_set c;
+		c.set(core);
+		return SetAffinity(c, hand);
+	}
+	/// <summary>
+	/// Sets the affinity from a mask, this only reaches the first 32 cpus. Use SetAffinity for more.
+	/// </summary>
+	/// <returns> Success if affinity could be set</returns>
+	bool SetAffinityMask(uint32_t mask, tHandle* hand = nullptr) {
+		return SetAffinity(cpu_set(mask), hand);
+	}
+	/// <summary>
+	/// Gets the affinity mask of the currently running thread! This only reaches the first 32 cpus. Use GetAffinity for more.
 	/// </summary>
 	/// <returns>The mask as an unsigned 32bit number.</returns>
 	uint32_t GetAffinityMask(tHandle* hand = nullptr) {
-		hand = hand ? hand : GetThreadHandle();
-		cpu_set_t cpuset;
-		auto s = pthread_getaffinity_np(*((pthread_t*)hand->handle), sizeof(cpi_set_t), &cupset);
-		// Finish this
-		return 0;
+		return (uint32_t)GetAffinity(hand).word(0);
 	}
 	/// <summary>
 	/// Get the core of the threads set affinity
 	/// </summary>
 	/// <returns> The core the thread is running on. If the affinity is set to multiple cores -1 is returned</returns>
-	int GetAffinityCore() {
-		auto mask = GetAffinityMask();
-		auto b = log2(mask);
-		if (floor(b) == b)
-			return b;
+	int GetAffinityCore(tHandle* hand = nullptr) {
+		auto set = GetAffinity(hand);
+		if (set.count() == 1)
+			return set.first();
 		return -1;
 	}
+	/// <summary>
+	/// Gets the numa node of the cpu the calling thread is running on
+	/// </summary>
+	inline int GetCurrentNode() {
+		int cpu = sched_getcpu();
+		return cpu < 0 ? 0 : (int)GetTopology().nodeOf((uint32_t)cpu);
+	}
+	/// <summary>
+	/// Allocates whole pages that prefer the memory of a numa node, node -1 leaves it up to the os. Free them with FreeOnNode.
+	/// The pages are only bound to the node on machines with more than one node, a failing mbind is ignored and leaves it to first touch
+	/// </summary>
+	inline void* AllocateOnNode(size_t bytes, int node) {
+		void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			throw std::bad_alloc();
+#ifdef SYS_mbind
+		if (node >= 0 && GetTopology().getNodeCount() > 1) {
+			const int preferred = 1; // MPOL_PREFERRED, numaif.h is not always installed
+			const size_t bits = sizeof(unsigned long) * 8;
+			std::vector<unsigned long> mask(node / bits + 2, 0); // One spare word, the kernel drops the last bit of maxnode
+			mask[node / bits] = 1UL << (node % bits);
+			syscall(SYS_mbind, p, bytes, preferred, mask.data(), mask.size() * bits, 0);
+		}
+#endif
+		return p;
+	}
+	inline void FreeOnNode(void* p, size_t bytes) {
+		munmap(p, bytes);
+	}
+#elif __unix || __unix__
+	// Unable to currently test!
+#error Unsupported platform
+#elif __APPLE__ || __MACH__
+	// Unable to currently test!
+#error Unsupported platform
 #elif __FreeBSD__
 	// Unable to currently test!
 #error Unsupported platform
 #else
 #error Unsupported platform
 #endif
+	/// <summary>
+	/// Pins a thread to the cpus of a numa node
+	/// </summary>
+	/// <returns> Success if affinity could be set</returns>
+	inline bool SetAffinityNode(int node, tHandle* hand = nullptr) {
+		auto& topo = GetTopology();
+		if (node < 0 || (size_t)node >= topo.getNodeCount())
+			return false;
+		return SetAffinity(topo.nodes[node], hand);
+	}
+	// Tells the cpu we are spinning, frees the core up for a hyperthread sibling and saves power
+	inline void CpuRelax() {
+#if defined(_WIN32) || defined(_WIN64)
+		YieldProcessor();
+#elif defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+		asm volatile("yield");
+#endif
+	}
 	enum class priority { core, very_high, high, above_normal, normal, below_normal, low, very_low, idle };
-	enum class scheduler { custom, round_robin };
+	const size_t priority_count = 9;
+	/// <summary>
+	/// Has the os schedule the calling thread according to a priority. On Linux core and very_high ask for SCHED_FIFO and SCHED_RR,
+	/// high to below_normal are nice levels, low and very_low are SCHED_BATCH and idle is SCHED_IDLE. On Windows it is the thread priority.
+	/// When the os does not allow a setting, the thread gets the closest one it does allow.
+	/// </summary>
+	/// <returns>False when a weaker setting had to be used</returns>
+	inline bool SetOsPriority(priority p) {
+#if defined(_WIN32) || defined(_WIN64)
+		static const int levels[priority_count] = { THREAD_PRIORITY_TIME_CRITICAL, THREAD_PRIORITY_HIGHEST, THREAD_PRIORITY_ABOVE_NORMAL,
+			THREAD_PRIORITY_ABOVE_NORMAL, THREAD_PRIORITY_NORMAL, THREAD_PRIORITY_BELOW_NORMAL, THREAD_PRIORITY_LOWEST, THREAD_PRIORITY_LOWEST, THREAD_PRIORITY_IDLE };
+		return ::SetThreadPriority(GetCurrentThread(), levels[(size_t)p]) != 0;
+#else
+		struct os_level {
+			int policy;
+			int rt; // Realtime priority for SCHED_FIFO and SCHED_RR
+			int nice; // Also the fallback when realtime is not allowed
+		};
+		static const os_level levels[priority_count] = { { SCHED_FIFO, 50, -15 }, { SCHED_RR, 10, -10 }, { SCHED_OTHER, 0, -5 }, { SCHED_OTHER, 0, -2 },
+			{ SCHED_OTHER, 0, 0 }, { SCHED_OTHER, 0, 5 }, { SCHED_BATCH, 0, 10 }, { SCHED_BATCH, 0, 19 }, { SCHED_IDLE, 0, 19 } };
+		const os_level& l = levels[(size_t)p];
+		pid_t tid = (pid_t)syscall(SYS_gettid); // Both calls work on a single thread when given its id
+		sched_param param{};
+		param.sched_priority = l.rt;
+		bool exact = true;
+		if (sched_setscheduler(tid, l.policy, &param) != 0) {
+			exact = false; // Realtime needs CAP_SYS_NICE or an RLIMIT_RTPRIO
+			param.sched_priority = 0;
+			sched_setscheduler(tid, SCHED_OTHER, &param);
+		}
+		if (l.policy == SCHED_FIFO || l.policy == SCHED_RR) {
+			if (exact)
+				return true;
+		}
+		if (setpriority(PRIO_PROCESS, (id_t)tid, l.nice) != 0) {
+			exact = false; // Going below the current nice level needs CAP_SYS_NICE or an RLIMIT_NICE
+			if (l.nice < 0)
+				setpriority(PRIO_PROCESS, (id_t)tid, 0);
+		}
+		return exact;
+#endif
+	}
+	/// <summary>
+	/// Where the threads of a runner run and how the os schedules them. Every thread applies its settings before it does anything else,
+	/// see SetAffinity and SetOsPriority. A priority that is not set leaves the thread with whatever it inherited, nice levels included.
+	/// </summary>
+	struct thread_options {
+		cpu_set affinity; // The cpus the threads may run on, when empty the numa node of the runner decides, or the os
+		std::optional<priority> loop; // The thread of a threaded runner
+		std::optional<priority> subsystem; // The timer thread
+	};
+	enum class scheduler { custom, round_robin, priority };
+	/// <summary>
+	/// How a looping runner waits once a pass found nothing to do. It spins for a number of passes with a cpu pause in between, then
+	/// yields for a number of passes and then parks until a timer fires, a call is handed to it or a task is added. Any pass that does
+	/// something starts over with spinning. A runner has nothing to do when no task is active and no timed object or call is waiting.
+	/// </summary>
+	struct idle_policy {
+		uint32_t spins = 4096;
+		uint32_t yields = 64;
+		bool park = true; // When false the runner keeps yielding instead
+		// Never gives up the core, for the lowest wake up latency
+		static idle_policy spin() {
+			return { UINT32_MAX, 0, false };
+		}
+		// A short spin to catch work that follows right after, then parks
+		static idle_policy balanced() {
+			return {};
+		}
+		// Parks right away, for runners that mostly wait on timers
+		static idle_policy sleep() {
+			return { 0, 0, true };
+		}
+	};
 	typedef std::chrono::high_resolution_clock Clock;
 	typedef std::chrono::nanoseconds nanoseconds;
 	typedef std::chrono::microseconds microseconds;
@@ -295,9 +944,126 @@ namespace multi {
 	const char _hour		= 0x5;
 
 	typedef std::chrono::time_point<std::chrono::high_resolution_clock> time;
+	/// <summary>
+	/// Where a runner reads the time from. Every source is turned into a time of Clock, so readings of different sources can be compared
+	/// and deadlines stay plain integer compares. Only the cost of a reading and its resolution differ. See runner::setClockSource
+	/// </summary>
+	enum class clock_source {
+		standard, // Clock::now()
+		monotonic, // CLOCK_MONOTONIC, QueryPerformanceCounter on Windows
+		monotonic_coarse, // CLOCK_MONOTONIC_COARSE, nearly free but only as fine as the kernel tick. GetTickCount64 on Windows
+		tsc // The time stamp counter of the cpu, calibrated against Clock. Only used when it is invariant, falls back to monotonic
+	};
+	// What it takes to turn the raw readings of the sources into Clock time, measured once
+	struct clock_calibration {
+		long long monotonicOffset = 0;
+		long long coarseOffset = 0;
+		bool tsc = false;
+		uint64_t tscBase = 0;
+		long long tscBaseNs = 0; // Clock time at tscBase
+		double nsPerTick = 0;
+	};
+	inline uint64_t ReadTSC() {
+#if defined(_WIN32) || defined(_WIN64)
+		return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+		return __builtin_ia32_rdtsc();
+#else
+		return 0;
+#endif
+	}
+	// An invariant counter ticks at the same rate in every power state and on every core, otherwise it is useless as a clock
+	inline bool HasInvariantTSC() {
+#if defined(_WIN32) || defined(_WIN64)
+		int r[4];
+		__cpuid(r, 0x80000000);
+		if ((unsigned)r[0] < 0x80000007)
+			return false;
+		__cpuid(r, 0x80000007);
+		return (r[3] >> 8) & 1;
+#elif defined(__x86_64__) || defined(__i386__)
+		unsigned a, b, c, d;
+		if (!__get_cpuid(0x80000007, &a, &b, &c, &d))
+			return false;
+		return (d >> 8) & 1;
+#else
+		return false;
+#endif
+	}
+	// Nanoseconds since some point in the past
+	inline long long ReadMonotonic(bool coarse) {
+#if defined(_WIN32) || defined(_WIN64)
+		if (coarse)
+			return (long long)GetTickCount64() * 1000000;
+		static const long long freq = [] {
+			LARGE_INTEGER f;
+			QueryPerformanceFrequency(&f);
+			return (long long)f.QuadPart;
+		}();
+		LARGE_INTEGER c;
+		QueryPerformanceCounter(&c);
+		return c.QuadPart / freq * 1000000000LL + c.QuadPart % freq * 1000000000LL / freq;
+#else
+		timespec ts;
+		clock_gettime(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+#endif
+	}
+	inline long long ClockNs(time t) {
+		return std::chrono::duration_cast<nanoseconds>(t.time_since_epoch()).count();
+	}
+	inline const clock_calibration& GetClockCalibration() {
+		static const clock_calibration cal = [] {
+			clock_calibration c;
+			c.monotonicOffset = ClockNs(Clock::now()) - ReadMonotonic(false);
+			c.coarseOffset = ClockNs(Clock::now()) - ReadMonotonic(true);
+			if (HasInvariantTSC()) {
+				// Count the ticks over 10 milliseconds
+				uint64_t t0 = ReadTSC();
+				time c0 = Clock::now();
+				time c1;
+				while ((c1 = Clock::now()) - c0 < milliseconds(10))
+					CpuRelax();
+				uint64_t t1 = ReadTSC();
+				if (t1 > t0) {
+					c.tsc = true;
+					c.nsPerTick = (double)std::chrono::duration_cast<nanoseconds>(c1 - c0).count() / (double)(t1 - t0);
+					c.tscBase = t1;
+					c.tscBaseNs = ClockNs(c1);
+				}
+			}
+			return c;
+		}();
+		return cal;
+	}
+	inline bool HasClockSource(clock_source s) {
+		return s != clock_source::tsc || GetClockCalibration().tsc;
+	}
+	/// <summary>
+	/// Reads the time from a source, as a time of Clock
+	/// </summary>
+	inline time Now(clock_source s) {
+		if (s == clock_source::standard)
+			return Clock::now();
+		const clock_calibration& cal = GetClockCalibration();
+		long long ns;
+		if (s == clock_source::tsc && cal.tsc)
+			ns = cal.tscBaseNs + (long long)((double)(long long)(ReadTSC() - cal.tscBase) * cal.nsPerTick);
+		else if (s == clock_source::monotonic_coarse)
+			ns = ReadMonotonic(true) + cal.coarseOffset;
+		else
+			ns = ReadMonotonic(false) + cal.monotonicOffset;
+		return time(std::chrono::duration_cast<Clock::duration>(nanoseconds(ns)));
+	}
 	typedef bool (*event_start)(mobj);
 	
 	typedef bool (*alarm_event)(mobj*);
+	// One alarm of runner::setAlarms, data ends up in the data of the object
+	struct alarm_spec {
+		long long set;
+		alarm_event evnt;
+		void* data = nullptr;
+	};
 	typedef bool (*step_event)(mobj*, size_t);
 	typedef bool (*loop_event)(mobj*);
 	typedef bool (*updater_event)(mobj*);
@@ -305,14 +1071,16 @@ namespace multi {
 
 	typedef bool (*event_end)(mobj);
 
-	typedef void (*reset)(mobj*);
 	template<typename T>
 	struct node {
 		node* prev = nullptr;
 		node* next = nullptr;
 		T* data = nullptr;
 		node<T>* addNode(T* dat) {
-			node* temp = new node();
+			return addNode(dat, new node());
+		}
+		// Links a node that was allocated somewhere else
+		node<T>* addNode(T* dat, node* temp) {
 			temp->head = false;
 			temp->data = dat;
 			if (next) {
@@ -388,199 +1156,2427 @@ namespace multi {
 			return val;
 		}
 		bool empty() {
+			std::unique_lock<std::mutex> mlock(mutex_);
 			return queue_.empty();
 		}
 
-		void pop(T& item)
+		bool try_pop(T& item)
+		{
+			std::unique_lock<std::mutex> mlock(mutex_);
+			if (queue_.empty())
+				return false;
+			item = queue_.front();
+			queue_.pop();
+			return true;
+		}
+
+		// Blocks until something is pushed
+		void wait()
 		{
 			std::unique_lock<std::mutex> mlock(mutex_);
 			while (queue_.empty())
 			{
 				cond_.wait(mlock);
 			}
-			item = queue_.front();
-			queue_.pop();
 		}
 
-		void push(const T& item)
+		// Blocks until something is pushed or the deadline has passed, returns false on timeout
+		template<typename C, typename D>
+		bool wait_until(const std::chrono::time_point<C, D>& deadline)
 		{
 			std::unique_lock<std::mutex> mlock(mutex_);
-			queue_.push(item);
-			mlock.unlock();
-			cond_.notify_one();
+			return cond_.wait_until(mlock, deadline, [this] { return !queue_.empty(); });
+		}
+
+		void pop(T& item)
+		{
+			std::unique_lock<std::mutex> mlock(mutex_);
+			while (queue_.empty())
+			{
+				cond_.wait(mlock);
+			}
+			item = queue_.front();
+			queue_.pop();
+		}
+
+		void push(const T& item)
+		{
+			std::unique_lock<std::mutex> mlock(mutex_);
+			queue_.push(item);
+			mlock.unlock();
+			cond_.notify_one();
 		}
 		Queue() = default;
 		Queue(const Queue&) = delete;            // disable copying
 		Queue& operator=(const Queue&) = delete; // disable assignment
 
 	private:
-		std::queue<T> queue_;
-		std::mutex mutex_;
-		std::condition_variable cond_;
+		std::queue<T> queue_;
+		std::mutex mutex_;
+		std::condition_variable cond_;
+	};
+	/// <summary>
+	/// Intrusive lock-free multi producer single consumer queue. The link is an atomic pointer member of T, so pushing never allocates.
+	/// Producers push onto a lock-free stack, the consumer takes the whole stack in one exchange and reverses it into FIFO order.
+	/// An object can only be in one queue at a time and must not be pushed again before the consumer has taken it out.
+	/// </summary>
+	template <typename T, std::atomic<T*> T::* Next>
+	class mpsc_queue
+	{
+	public:
+		// Can be called from any thread
+		void push(T* item)
+		{
+			T* old = head_.load(std::memory_order_relaxed);
+			do {
+				(item->*Next).store(old, std::memory_order_relaxed);
+			} while (!head_.compare_exchange_weak(old, item, std::memory_order_seq_cst, std::memory_order_relaxed));
+			// Only the push that makes the queue non empty can find the consumer parked
+			if (old == nullptr && sleeping_.load(std::memory_order_seq_cst)) {
+				{ std::lock_guard<std::mutex> mlock(mutex_); }
+				cond_.notify_one();
+			}
+		}
+		// Pushes a chain that is already linked through Next in one go, first is taken out last. Can be called from any thread
+		void push_chain(T* first, T* last)
+		{
+			T* old = head_.load(std::memory_order_relaxed);
+			do {
+				(last->*Next).store(old, std::memory_order_relaxed);
+			} while (!head_.compare_exchange_weak(old, first, std::memory_order_seq_cst, std::memory_order_relaxed));
+			if (old == nullptr && sleeping_.load(std::memory_order_seq_cst)) {
+				{ std::lock_guard<std::mutex> mlock(mutex_); }
+				cond_.notify_one();
+			}
+		}
+		// The rest of the methods must only be called by the consumer
+
+		bool try_pop(T*& item)
+		{
+			if (!pending_)
+				refill();
+			if (!pending_)
+				return false;
+			item = pending_;
+			pending_ = next(item);
+			if (!pending_)
+				pending_tail_ = nullptr;
+			return true;
+		}
+		/// <summary>
+		/// Takes everything out of the queue at once
+		/// </summary>
+		/// <returns>The first object of a FIFO chain, use next() to walk it. nullptr if the queue was empty</returns>
+		T* drain_all()
+		{
+			refill();
+			T* batch = pending_;
+			pending_ = pending_tail_ = nullptr;
+			return batch;
+		}
+		static inline T* next(T* item)
+		{
+			return (item->*Next).load(std::memory_order_relaxed);
+		}
+		bool empty() const
+		{
+			return pending_ == nullptr && head_.load(std::memory_order_seq_cst) == nullptr;
+		}
+		// Can be called from any thread, makes a parked consumer return from wait even if nothing was pushed
+		void wake()
+		{
+			{
+				std::lock_guard<std::mutex> mlock(mutex_);
+				woken_ = true;
+			}
+			cond_.notify_one();
+		}
+		// Can be called from any thread, wakes a parked consumer that has work coming in some other way, see the more argument of wait
+		void notify()
+		{
+			if (sleeping_.load(std::memory_order_seq_cst))
+				wake();
+		}
+		// Blocks until something is pushed, only parks the thread when the queue is empty
+		void wait()
+		{
+			wait([] { return false; });
+		}
+		// Also returns once more() is true, whoever makes it true has to call notify afterwards
+		template<typename P>
+		void wait(P more)
+		{
+			if (!empty() || more())
+				return;
+			std::unique_lock<std::mutex> mlock(mutex_);
+			sleeping_.store(true, std::memory_order_seq_cst);
+			cond_.wait(mlock, [this, &more] { return head_.load(std::memory_order_seq_cst) != nullptr || woken_ || more(); });
+			woken_ = false;
+			sleeping_.store(false, std::memory_order_relaxed);
+		}
+		// Blocks until something is pushed or the deadline has passed, returns false on timeout
+		template<typename C, typename D>
+		bool wait_until(const std::chrono::time_point<C, D>& deadline)
+		{
+			return wait_until(deadline, [] { return false; });
+		}
+		template<typename C, typename D, typename P>
+		bool wait_until(const std::chrono::time_point<C, D>& deadline, P more)
+		{
+			if (!empty() || more())
+				return true;
+			std::unique_lock<std::mutex> mlock(mutex_);
+			sleeping_.store(true, std::memory_order_seq_cst);
+			bool r = cond_.wait_until(mlock, deadline, [this, &more] { return head_.load(std::memory_order_seq_cst) != nullptr || woken_ || more(); });
+			woken_ = false;
+			sleeping_.store(false, std::memory_order_relaxed);
+			return r;
+		}
+		mpsc_queue() = default;
+		mpsc_queue(const mpsc_queue&) = delete;            // disable copying
+		mpsc_queue& operator=(const mpsc_queue&) = delete; // disable assignment
+
+	private:
+		// Moves everything the producers pushed onto the end of the consumer's pending chain
+		void refill()
+		{
+			if (head_.load(std::memory_order_relaxed) == nullptr)
+				return;
+			T* stack = head_.exchange(nullptr, std::memory_order_acquire);
+			T* first = nullptr;
+			T* last = stack;
+			while (stack) {
+				T* n = next(stack);
+				(stack->*Next).store(first, std::memory_order_relaxed);
+				first = stack;
+				stack = n;
+			}
+			if (pending_tail_)
+				(pending_tail_->*Next).store(first, std::memory_order_relaxed);
+			else
+				pending_ = first;
+			pending_tail_ = last;
+		}
+		alignas(64) std::atomic<T*> head_{ nullptr };
+		std::atomic<bool> sleeping_{ false };
+		alignas(64) T* pending_ = nullptr;
+		T* pending_tail_ = nullptr;
+		bool woken_ = false;
+		std::mutex mutex_;
+		std::condition_variable cond_;
+	};
+	// End queue
+	/// <summary>
+	/// Epoch based reclamation for objects that threads other than their owner may still be looking at. Such a thread only touches them
+	/// inside of an epoch_guard. Memory that was retired in epoch e is reused once the epoch has reached e + 2, by then every thread that
+	/// could have seen the object has left its guard. Entering and leaving is a store each and nobody ever waits on anyone, the owner
+	/// just keeps the memory a little longer when a guard is open. There is one domain for the whole process, see GetEpochDomain.
+	/// </summary>
+	class epoch_domain {
+	public:
+		static constexpr size_t max_threads = 1024; // Threads that are inside a guard at the same time, more of them wait for one to leave
+		void enter() {
+			local& l = current_thread();
+			if (l.depth++ == 0) {
+				l.s = claim(l.hint);
+				l.s->epoch.store(global.load(std::memory_order_relaxed), std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst); // Announced before anything shared is touched
+			}
+		}
+		void leave() {
+			local& l = current_thread();
+			if (--l.depth == 0) {
+				l.s->epoch.store(0, std::memory_order_release);
+				l.s->taken.store(false, std::memory_order_release); // A slot is only held while the thread is inside a guard
+				l.s = nullptr;
+			}
+		}
+		uint64_t current() const {
+			return global.load(std::memory_order_seq_cst);
+		}
+		/// <summary>
+		/// Moves the epoch on when every thread inside a guard has seen the current one
+		/// </summary>
+		/// <returns>The epoch after the attempt</returns>
+		uint64_t advance() {
+			uint64_t g = global.load(std::memory_order_seq_cst);
+			size_t n = used.load(std::memory_order_acquire);
+			for (size_t i = 0; i < n; i++) {
+				uint64_t e = slots[i].epoch.load(std::memory_order_seq_cst);
+				if (e != 0 && e != g)
+					return g; // Someone is still in an older epoch
+			}
+			if (global.compare_exchange_strong(g, g + 1, std::memory_order_seq_cst))
+				return g + 1;
+			return g;
+		}
+		// True once nothing retired in epoch retired can be looked at anymore
+		static inline bool isSafe(uint64_t retired, uint64_t now) {
+			return now >= retired + 2;
+		}
+	private:
+		struct alignas(64) slot {
+			std::atomic<uint64_t> epoch{ 0 }; // 0 while the thread is outside
+			std::atomic<bool> taken{ false };
+		};
+		// What a thread knows about its own guards
+		struct local {
+			slot* s = nullptr;
+			uint32_t depth = 0;
+			size_t hint = 0; // The slot it had last time, most of the time it is still free
+		};
+		static local& current_thread() {
+			thread_local local l;
+			return l;
+		}
+		slot* claim(size_t& hint) {
+			for (;;) {
+				for (size_t k = 0; k < max_threads; k++) {
+					size_t i = (hint + k) % max_threads;
+					bool expected = false;
+					if (!slots[i].taken.load(std::memory_order_relaxed) && slots[i].taken.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+						size_t n = used.load(std::memory_order_relaxed);
+						while (n < i + 1 && !used.compare_exchange_weak(n, i + 1));
+						hint = i;
+						return &slots[i];
+					}
+				}
+				std::this_thread::yield(); // Every slot is in a guard right now, one of them leaves soon
+			}
+		}
+		alignas(64) std::atomic<uint64_t> global{ 1 };
+		std::atomic<size_t> used{ 0 }; // Slots past this were never handed out
+		slot slots[max_threads];
+	};
+	inline epoch_domain& GetEpochDomain() {
+		static epoch_domain domain;
+		return domain;
+	}
+	// Keeps the objects a thread looks at from being reused until the guard goes out of scope
+	struct epoch_guard {
+		epoch_guard() {
+			GetEpochDomain().enter();
+		}
+		~epoch_guard() {
+			GetEpochDomain().leave();
+		}
+		epoch_guard(const epoch_guard&) = delete;
+		epoch_guard& operator=(const epoch_guard&) = delete;
+	};
+	/// <summary>
+	/// The part of a channel that parks a receiving object of a runner. A parked receiver is handed back to its runner by the next send,
+	/// so a receiver that has nothing to do costs nothing. Channels that never had a receiver parked on them skip all of this.
+	/// </summary>
+	class channel_waiter {
+	public:
+		// Parks m, wake is called with it from the sending thread. Check the channel again afterwards and call unpark if it is not empty
+		void park(mobj* m, void (*wake)(mobj*)) {
+			wake_ = wake;
+			wakeable_.store(true, std::memory_order_relaxed);
+			waiter_.store(m, std::memory_order_seq_cst);
+			std::atomic_thread_fence(std::memory_order_seq_cst); // The check of the channel that follows must not move above this
+		}
+		// Takes back the parked object, nullptr if a sender was faster and already woke it
+		mobj* unpark() {
+			return waiter_.exchange(nullptr);
+		}
+	protected:
+		void wakeReceiver() {
+			if (!wakeable_.load(std::memory_order_relaxed))
+				return;
+			std::atomic_thread_fence(std::memory_order_seq_cst); // The message must be visible before we look for a receiver
+			if (waiter_.load(std::memory_order_relaxed)) {
+				if (mobj* m = waiter_.exchange(nullptr))
+					wake_(m);
+			}
+		}
+	private:
+		std::atomic<mobj*> waiter_{ nullptr };
+		std::atomic<bool> wakeable_{ false };
+		void (*wake_)(mobj*) = nullptr;
+	};
+	inline size_t RoundUpPow2(size_t n) {
+		size_t p = 1;
+		while (p < n)
+			p <<= 1;
+		return p;
+	}
+	/// <summary>
+	/// Bounded single producer single consumer channel. The capacity is rounded up to a power of two. Messages are moved in and
+	/// handed to the receiver in place, nothing is copied or allocated after construction. The producer and consumer indices live on
+	/// their own cache lines and each side keeps a cached copy of the other's index, so the line only moves when the cache runs out.
+	/// </summary>
+	template<typename T>
+	class spsc_channel : public channel_waiter {
+	public:
+		typedef T value_type;
+		explicit spsc_channel(size_t capacity) : mask_(RoundUpPow2(capacity ? capacity : 1) - 1), cells_(new cell[mask_ + 1]) {}
+		spsc_channel(const spsc_channel&) = delete;            // disable copying
+		spsc_channel& operator=(const spsc_channel&) = delete; // disable assignment
+		~spsc_channel() {
+			while (consume([](T&) {}));
+			delete[] cells_;
+		}
+		// Producer only, false when the channel is full
+		template<typename... Args>
+		bool try_emplace(Args&&... args) {
+			size_t t = tail_.load(std::memory_order_relaxed);
+			if (t - headCache_ > mask_) {
+				headCache_ = head_.load(std::memory_order_acquire);
+				if (t - headCache_ > mask_)
+					return false;
+			}
+			new (cells_[t & mask_].bytes) T(std::forward<Args>(args)...);
+			tail_.store(t + 1, std::memory_order_release);
+			wakeReceiver();
+			return true;
+		}
+		bool try_send(T&& v) {
+			return try_emplace(std::move(v));
+		}
+		// Consumer only, calls f with the next message in place and destroys it afterwards. False when the channel is empty
+		template<typename F>
+		bool consume(F&& f) {
+			size_t h = head_.load(std::memory_order_relaxed);
+			if (h == tailCache_) {
+				tailCache_ = tail_.load(std::memory_order_acquire);
+				if (h == tailCache_)
+					return false;
+			}
+			T* v = reinterpret_cast<T*>(cells_[h & mask_].bytes);
+			f(*v);
+			v->~T();
+			head_.store(h + 1, std::memory_order_release);
+			return true;
+		}
+		bool try_recv(T& out) {
+			return consume([&](T& v) { out = std::move(v); });
+		}
+		bool empty() const {
+			return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+		}
+		size_t size() const {
+			return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire);
+		}
+		size_t capacity() const {
+			return mask_ + 1;
+		}
+	private:
+		struct cell {
+			alignas(T) unsigned char bytes[sizeof(T)];
+		};
+		const size_t mask_;
+		cell* const cells_;
+		alignas(64) std::atomic<size_t> tail_{ 0 };
+		size_t headCache_ = 0;
+		alignas(64) std::atomic<size_t> head_{ 0 };
+		size_t tailCache_ = 0;
+	};
+	/// <summary>
+	/// Bounded multi producer single consumer channel. Every cell carries a sequence number that tells whether it is free or holds a
+	/// message, producers claim cells with a compare exchange on the tail and the consumer never writes to a shared index.
+	/// Like the spsc_channel messages are moved in and received in place, and the capacity is rounded up to a power of two.
+	/// </summary>
+	template<typename T>
+	class mpsc_channel : public channel_waiter {
+	public:
+		typedef T value_type;
+		explicit mpsc_channel(size_t capacity) : mask_(RoundUpPow2(capacity ? capacity : 1) - 1), cells_(new cell[mask_ + 1]) {
+			for (size_t i = 0; i <= mask_; i++)
+				cells_[i].seq.store(i, std::memory_order_relaxed);
+		}
+		mpsc_channel(const mpsc_channel&) = delete;            // disable copying
+		mpsc_channel& operator=(const mpsc_channel&) = delete; // disable assignment
+		~mpsc_channel() {
+			while (consume([](T&) {}));
+			delete[] cells_;
+		}
+		// Any thread, false when the channel is full
+		template<typename... Args>
+		bool try_emplace(Args&&... args) {
+			size_t pos = tail_.load(std::memory_order_relaxed);
+			cell* c;
+			for (;;) {
+				c = &cells_[pos & mask_];
+				size_t seq = c->seq.load(std::memory_order_acquire);
+				intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+				if (dif == 0) {
+					if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+						break;
+				}
+				else if (dif < 0)
+					return false; // The consumer has not freed this cell yet
+				else
+					pos = tail_.load(std::memory_order_relaxed);
+			}
+			new (c->bytes) T(std::forward<Args>(args)...);
+			c->seq.store(pos + 1, std::memory_order_release);
+			wakeReceiver();
+			return true;
+		}
+		bool try_send(T&& v) {
+			return try_emplace(std::move(v));
+		}
+		// Consumer only, calls f with the next message in place and destroys it afterwards. False when the channel is empty
+		template<typename F>
+		bool consume(F&& f) {
+			cell& c = cells_[head_ & mask_];
+			if (c.seq.load(std::memory_order_acquire) != head_ + 1)
+				return false;
+			T* v = reinterpret_cast<T*>(c.bytes);
+			f(*v);
+			v->~T();
+			c.seq.store(head_ + mask_ + 1, std::memory_order_release);
+			head_++;
+			return true;
+		}
+		bool try_recv(T& out) {
+			return consume([&](T& v) { out = std::move(v); });
+		}
+		// Consumer only
+		bool empty() const {
+			return cells_[head_ & mask_].seq.load(std::memory_order_acquire) != head_ + 1;
+		}
+		size_t capacity() const {
+			return mask_ + 1;
+		}
+	private:
+		struct cell {
+			std::atomic<size_t> seq;
+			alignas(T) unsigned char bytes[sizeof(T)];
+		};
+		const size_t mask_;
+		cell* const cells_;
+		alignas(64) std::atomic<size_t> tail_{ 0 };
+		alignas(64) size_t head_ = 0;
+	};
+	/// <summary>
+	/// Chase-Lev work stealing deque of pointers. The owning thread pushes and takes at the bottom, any thread can steal from the top.
+	/// The buffer grows when full, old buffers are kept until the deque is destroyed since a thief might still be reading them.
+	/// </summary>
+	template <typename T>
+	class ws_deque
+	{
+	public:
+		ws_deque(size_t capacity = 64) {
+			size_t c = 1;
+			while (c < capacity)
+				c <<= 1;
+			buffer_.store(new array(c), std::memory_order_relaxed);
+		}
+		~ws_deque() {
+			delete buffer_.load(std::memory_order_relaxed);
+			for (auto a : retired_)
+				delete a;
+		}
+		ws_deque(const ws_deque&) = delete;            // disable copying
+		ws_deque& operator=(const ws_deque&) = delete; // disable assignment
+		// Owner only
+		void push(T* item) {
+			int64_t b = bottom_.load(std::memory_order_relaxed);
+			int64_t t = top_.load(std::memory_order_acquire);
+			array* a = buffer_.load(std::memory_order_relaxed);
+			if (b - t > (int64_t)a->mask) {
+				array* bigger = new array((a->mask + 1) * 2);
+				for (int64_t i = t; i < b; i++)
+					bigger->put(i, a->get(i));
+				retired_.push_back(a);
+				buffer_.store(bigger, std::memory_order_release);
+				a = bigger;
+			}
+			a->put(b, item);
+			std::atomic_thread_fence(std::memory_order_release);
+			bottom_.store(b + 1, std::memory_order_relaxed);
+		}
+		// Owner only, takes the most recently pushed item. nullptr if empty
+		T* take() {
+			int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+			array* a = buffer_.load(std::memory_order_relaxed);
+			bottom_.store(b, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t t = top_.load(std::memory_order_relaxed);
+			T* item = nullptr;
+			if (t <= b) {
+				item = a->get(b);
+				if (t == b) {
+					// Last item, race the thieves for it
+					if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+						item = nullptr;
+					bottom_.store(b + 1, std::memory_order_relaxed);
+				}
+			}
+			else {
+				bottom_.store(b + 1, std::memory_order_relaxed);
+			}
+			return item;
+		}
+		// Owner only, moves the items into a buffer allocated by the calling thread so its pages are first touched on that thread's node. Thieves see it like a grow
+		void rehome() {
+			int64_t b = bottom_.load(std::memory_order_relaxed);
+			int64_t t = top_.load(std::memory_order_acquire);
+			array* a = buffer_.load(std::memory_order_relaxed);
+			array* fresh = new array(a->mask + 1);
+			for (int64_t i = t; i < b; i++)
+				fresh->put(i, a->get(i));
+			retired_.push_back(a);
+			buffer_.store(fresh, std::memory_order_release);
+		}
+		// Any thread, takes the oldest item. nullptr if empty or another thread won the race
+		T* steal() {
+			int64_t t = top_.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			int64_t b = bottom_.load(std::memory_order_acquire);
+			if (t < b) {
+				array* a = buffer_.load(std::memory_order_acquire);
+				T* item = a->get(t);
+				if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+					return nullptr;
+				return item;
+			}
+			return nullptr;
+		}
+		// Any thread, only a snapshot
+		size_t size() const {
+			int64_t b = bottom_.load(std::memory_order_relaxed);
+			int64_t t = top_.load(std::memory_order_relaxed);
+			return b > t ? (size_t)(b - t) : 0;
+		}
+	private:
+		struct array {
+			size_t mask;
+			std::atomic<T*>* items;
+			array(size_t c) : mask(c - 1), items(new std::atomic<T*>[c]) {}
+			~array() { delete[] items; }
+			inline T* get(int64_t i) const { return items[i & mask].load(std::memory_order_relaxed); }
+			inline void put(int64_t i, T* v) { items[i & mask].store(v, std::memory_order_relaxed); }
+		};
+		alignas(64) std::atomic<int64_t> top_{ 0 };
+		alignas(64) std::atomic<int64_t> bottom_{ 0 };
+		std::atomic<array*> buffer_;
+		std::vector<array*> retired_;
+	};
+	/// <summary>
+	/// Fixed size block allocator. Blocks are carved out of chunks of PerChunk blocks and recycled through a free list, so once it is
+	/// warmed up allocating and releasing never touches the heap. Not thread safe, the owner decides which thread may use it.
+	/// </summary>
+	template <typename T, size_t PerChunk = 64>
+	class slab
+	{
+	public:
+		slab() = default;
+		slab(const slab&) = delete;            // disable copying
+		slab& operator=(const slab&) = delete; // disable assignment
+		~slab() {
+			// Blocks that are still handed out are not destroyed, only their memory is given back
+			for (auto& c : chunks_) {
+				if (c.paged)
+					FreeOnNode(c.mem, c.bytes);
+				else
+					::operator delete(c.mem);
+			}
+		}
+		/// <summary>
+		/// Takes new chunks from the memory of a numa node, -1 goes back to the heap. Cells that were handed out already stay where they are
+		/// </summary>
+		void setNode(int node) {
+			node_ = node;
+		}
+		int getNode() const {
+			return node_;
+		}
+		// Uninitialized memory for one T
+		void* allocate() {
+			if (!free_)
+				grow();
+			cell* c = free_;
+			free_ = c->next;
+			live_++;
+			return c;
+		}
+		void release(void* p) {
+			cell* c = static_cast<cell*>(p);
+			c->next = free_;
+			free_ = c;
+			live_--;
+		}
+		// Makes sure the next n allocations do not go to the heap, whatever is missing comes in one chunk
+		void reserve(size_t n) {
+			size_t spare = capacity_ - live_;
+			if (n > spare)
+				grow(n - spare);
+		}
+		// The number of times the slab had to go to the heap
+		size_t getAllocationCount() const {
+			return chunks_.size();
+		}
+		size_t getLiveCount() const {
+			return live_;
+		}
+	private:
+		union cell {
+			cell* next;
+			alignas(T) unsigned char storage[sizeof(T)];
+		};
+		struct chunk {
+			void* mem;
+			size_t bytes;
+			bool paged; // From AllocateOnNode instead of the heap
+		};
+		void grow(size_t count = PerChunk) {
+			// Over allocate so the cells can be aligned by hand, aligned new is not available on every compiler we build with
+			size_t bytes = sizeof(cell) * count + alignof(cell);
+			void* raw;
+			if (node_ >= 0)
+				raw = AllocateOnNode(bytes, node_); // Page aligned, so the cells are too
+			else
+				raw = ::operator new(bytes);
+			chunks_.push_back({ raw, bytes, node_ >= 0 });
+			uintptr_t p = reinterpret_cast<uintptr_t>(raw);
+			p = (p + alignof(cell) - 1) & ~(uintptr_t)(alignof(cell) - 1);
+			cell* cells = reinterpret_cast<cell*>(p);
+			for (size_t i = count; i-- > 0;) {
+				cells[i].next = free_;
+				free_ = &cells[i];
+			}
+			capacity_ += count;
+		}
+		cell* free_ = nullptr;
+		size_t live_ = 0;
+		size_t capacity_ = 0;
+		int node_ = -1;
+		std::vector<chunk> chunks_;
+	};
+#ifdef MULTI_STATS
+	/// <summary>
+	/// A plain copy of a histogram. Values are counted in log linear buckets, every power of two is split into 2^SubBits buckets,
+	/// so a percentile is off by at most 1 / 2^SubBits of its value. Values of 2^Octaves and up land in the last bucket.
+	/// </summary>
+	template<int SubBits, int Octaves>
+	struct histogram_data {
+		static constexpr int Sub = 1 << SubBits;
+		static constexpr int Buckets = (Octaves - SubBits + 1) * Sub;
+		uint64_t counts[Buckets] = {};
+		uint64_t count = 0;
+		uint64_t sum = 0;
+		uint64_t max = 0;
+		static int bucketOf(uint64_t v) {
+			if (v < (uint64_t)Sub)
+				return (int)v;
+			int shift = highest_bit(v) - SubBits;
+			int b = (shift + 1) * Sub + (int)((v >> shift) & (Sub - 1));
+			return b < Buckets ? b : Buckets - 1;
+		}
+		// The largest value that lands in a bucket
+		static uint64_t bucketTop(int b) {
+			if (b < Sub)
+				return (uint64_t)b;
+			int shift = b / Sub - 1;
+			return (((uint64_t)(Sub + b % Sub) + 1) << shift) - 1;
+		}
+		// The value that p percent of the recorded values are at or below, p goes from 0 to 100
+		uint64_t percentile(double p) const {
+			if (!count)
+				return 0;
+			uint64_t rank = (uint64_t)std::ceil(p / 100.0 * count);
+			rank = rank ? rank : 1;
+			uint64_t seen = 0;
+			for (int b = 0; b < Buckets; b++) {
+				seen += counts[b];
+				if (seen >= rank)
+					return bucketTop(b) < max ? bucketTop(b) : max;
+			}
+			return max;
+		}
+		double mean() const {
+			return count ? (double)sum / count : 0;
+		}
+	};
+	/// <summary>
+	/// A histogram with one writer that any thread can read while it is being written to. A copy may be a few values behind the writer.
+	/// </summary>
+	template<int SubBits, int Octaves>
+	class histogram {
+	public:
+		typedef histogram_data<SubBits, Octaves> data;
+		void record(uint64_t v) {
+			bump(counts[data::bucketOf(v)], 1);
+			bump(count, 1);
+			bump(sum, v);
+			if (v > max.load(std::memory_order_relaxed))
+				max.store(v, std::memory_order_relaxed);
+		}
+		void read(data& out) const {
+			for (int b = 0; b < data::Buckets; b++)
+				out.counts[b] = counts[b].load(std::memory_order_relaxed);
+			out.count = count.load(std::memory_order_relaxed);
+			out.sum = sum.load(std::memory_order_relaxed);
+			out.max = max.load(std::memory_order_relaxed);
+		}
+		void reset() {
+			for (auto& c : counts)
+				c.store(0, std::memory_order_relaxed);
+			count.store(0, std::memory_order_relaxed);
+			sum.store(0, std::memory_order_relaxed);
+			max.store(0, std::memory_order_relaxed);
+		}
+	private:
+		// There is only one writer, a read modify write is not needed
+		static void bump(std::atomic<uint64_t>& c, uint64_t by) {
+			c.store(c.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+		}
+		std::atomic<uint64_t> counts[data::Buckets] = {};
+		std::atomic<uint64_t> count{ 0 };
+		std::atomic<uint64_t> sum{ 0 };
+		std::atomic<uint64_t> max{ 0 };
+	};
+	typedef histogram<1, 40> task_histogram; // Kept small, every object has two of these
+	typedef histogram<3, 40> runner_histogram;
+	/// <summary>
+	/// What a runner records about one of its objects, all times are in nanoseconds. The runtime histogram also holds the number of
+	/// invocations (count), the total (sum) and the longest run (max). The lateness is how long a timed object waited between its
+	/// deadline and being run. Entries are never freed while the runner is alive, the entry of a destroyed object is reused.
+	/// </summary>
+	struct task_stats {
+		std::atomic<const mobj*> owner{ nullptr }; // nullptr once the object is destroyed
+		std::atomic<const char*> type{ nullptr };
+		task_histogram runtime;
+		task_histogram lateness;
+		task_stats* nextStats = nullptr; // Every entry of the runner, set before the entry is published
+		task_stats* nextFree = nullptr; // Entries of destroyed objects, only touched by the runner
+	};
+	struct task_snapshot {
+		const mobj* obj; // Only good for telling tasks apart, the object may be gone by now
+		const char* type;
+		task_histogram::data runtime;
+		task_histogram::data lateness;
+	};
+	struct runner_snapshot {
+		uint64_t passes = 0;
+		nanoseconds uptime{ 0 };
+		runner_histogram::data sweep; // How long the subsystem took to take in new timers and hand out the due ones, per wake up
+		std::vector<task_snapshot> tasks;
+		double getPassRate() const {
+			return uptime.count() ? passes * 1e9 / uptime.count() : 0;
+		}
+	};
+	inline uint64_t ElapsedSince(time begin) {
+		auto d = std::chrono::duration_cast<nanoseconds>(Clock::now() - begin).count();
+		return d > 0 ? (uint64_t)d : 0;
+	}
+#endif
+#ifdef MULTI_TRACE
+#ifndef MULTI_TRACE_EVENTS
+#define MULTI_TRACE_EVENTS 32768 // Events every thread keeps, the oldest are overwritten. Has to be a power of two
+#endif
+	enum class trace_kind : uint32_t {
+		run, // An object ran, obj is the object and ctx its runner
+		expire, // The subsystem found a timer due, begin is its deadline and end the sweep that found it
+		dispatch, // The runner took a due timer off its readyQueue, the run follows right after
+		sweep // The subsystem took in count new timers and handed out the due ones
+	};
+	struct trace_event {
+		trace_kind kind;
+		uint32_t count;
+		const void* obj;
+		const void* ctx; // The runner of the object
+		const char* name; // The type of the object, the object itself may be gone by the time the trace is written
+		time begin;
+		time end;
+	};
+	/// <summary>
+	/// The events of one thread. Only that thread writes, so recording is a handful of plain stores. Every slot has a sequence number that
+	/// is odd while the slot is written, a reader copies a slot and keeps it only if the number was even and the same before and after.
+	/// </summary>
+	class trace_ring {
+	public:
+		static constexpr size_t capacity = MULTI_TRACE_EVENTS;
+		static_assert((capacity & (capacity - 1)) == 0, "MULTI_TRACE_EVENTS has to be a power of two");
+		trace_ring(uint64_t id) : tid(id) {}
+		void record(const trace_event& e) {
+			uint64_t h = head.load(std::memory_order_relaxed);
+			slot& s = slots[h & (capacity - 1)];
+			s.seq.store(h * 2 + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			s.words[0].store((uint64_t)e.kind << 32 | e.count, std::memory_order_relaxed);
+			s.words[1].store((uint64_t)(uintptr_t)e.obj, std::memory_order_relaxed);
+			s.words[2].store((uint64_t)(uintptr_t)e.ctx, std::memory_order_relaxed);
+			s.words[3].store((uint64_t)(uintptr_t)e.name, std::memory_order_relaxed);
+			s.words[4].store((uint64_t)e.begin.time_since_epoch().count(), std::memory_order_relaxed);
+			s.words[5].store((uint64_t)e.end.time_since_epoch().count(), std::memory_order_relaxed);
+			s.seq.store(h * 2 + 2, std::memory_order_release);
+			head.store(h + 1, std::memory_order_release);
+		}
+		// Copies the events that are still in the ring, an event that is overwritten while it is read is left out
+		template<typename F>
+		void read(F&& f) const {
+			uint64_t h = head.load(std::memory_order_acquire);
+			uint64_t from = start.load(std::memory_order_relaxed);
+			if (h - from > capacity)
+				from = h - capacity;
+			for (uint64_t i = from; i < h; i++) {
+				const slot& s = slots[i & (capacity - 1)];
+				uint64_t seq = s.seq.load(std::memory_order_acquire);
+				if (seq != i * 2 + 2)
+					continue;
+				uint64_t w[words];
+				for (size_t k = 0; k < words; k++)
+					w[k] = s.words[k].load(std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_acquire);
+				if (s.seq.load(std::memory_order_relaxed) != seq)
+					continue;
+				trace_event e;
+				e.kind = (trace_kind)(w[0] >> 32);
+				e.count = (uint32_t)w[0];
+				e.obj = (const void*)(uintptr_t)w[1];
+				e.ctx = (const void*)(uintptr_t)w[2];
+				e.name = (const char*)(uintptr_t)w[3];
+				e.begin = time(time::duration((time::rep)w[4]));
+				e.end = time(time::duration((time::rep)w[5]));
+				f(e);
+			}
+		}
+		// Forgets what was recorded so far, the writer is never held up
+		void clear() {
+			start.store(head.load(std::memory_order_acquire), std::memory_order_relaxed);
+		}
+		uint64_t tid;
+		std::atomic<const char*> name{ nullptr };
+	private:
+		static constexpr size_t words = 6;
+		struct slot {
+			std::atomic<uint64_t> seq{ 0 };
+			std::atomic<uint64_t> words[trace_ring::words] = {};
+		};
+		slot slots[capacity];
+		alignas(64) std::atomic<uint64_t> head{ 0 };
+		std::atomic<uint64_t> start{ 0 };
+	};
+	/// <summary>
+	/// Every trace_ring of the process. A thread gets its ring the first time it records and the ring stays after the thread is gone,
+	/// so its events can still be written out. Writing reads the rings while the threads keep recording. See GetTraceLog and WriteTrace.
+	/// </summary>
+	class trace_log {
+	public:
+		trace_ring& local() {
+			thread_local trace_ring* ring = nullptr;
+			if (!ring) {
+				auto r = std::make_unique<trace_ring>(threadId());
+				ring = r.get();
+				std::lock_guard<std::mutex> lock(mutex);
+				rings.push_back(std::move(r));
+			}
+			return *ring;
+		}
+		inline bool isEnabled() const {
+			return enabled.load(std::memory_order_relaxed);
+		}
+		// Recording is on from the start, turn it off to only trace a window of interest
+		void setEnabled(bool on) {
+			enabled.store(on, std::memory_order_relaxed);
+		}
+		void clear() {
+			std::lock_guard<std::mutex> lock(mutex);
+			for (auto& r : rings)
+				r->clear();
+		}
+		/// <summary>
+		/// Writes everything that is recorded as Chrome trace event json, which chrome://tracing and ui.perfetto.dev open.
+		/// Runs become slices on their thread, due timers are arrows from the sweep that found them to the run they caused.
+		/// </summary>
+		void write(FILE* f) {
+			std::lock_guard<std::mutex> lock(mutex);
+			fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+			bool first = true;
+			auto sep = [&] {
+				if (!first)
+					fprintf(f, ",\n");
+				first = false;
+			};
+			for (auto& r : rings) {
+				const char* name = r->name.load(std::memory_order_relaxed);
+				sep();
+				fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%llu,\"args\":{\"name\":\"", (unsigned long long)r->tid);
+				escape(f, name ? name : "thread");
+				fprintf(f, "\"}}");
+				r->read([&](const trace_event& e) {
+					sep();
+					unsigned long long tid = r->tid;
+					switch (e.kind) {
+					case trace_kind::run:
+						fprintf(f, "{\"name\":\"");
+						escape(f, e.name ? e.name : "mobj");
+						fprintf(f, "\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"obj\":\"%p\",\"runner\":\"%p\"}}",
+							tid, us(e.begin), us(e.end) - us(e.begin), e.obj, e.ctx);
+						break;
+					case trace_kind::expire:
+						fprintf(f, "{\"name\":\"expire\",\"cat\":\"timer\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"args\":{\"type\":\"%s\",\"obj\":\"%p\",\"runner\":\"%p\",\"deadline\":%.3f,\"late_us\":%.3f}},\n",
+							tid, us(e.end), e.name ? e.name : "mobj", e.obj, e.ctx, us(e.begin), us(e.end) - us(e.begin));
+						fprintf(f, "{\"name\":\"timer\",\"cat\":\"timer\",\"ph\":\"s\",\"id\":\"%p\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f}", e.obj, tid, us(e.end));
+						break;
+					case trace_kind::dispatch:
+						fprintf(f, "{\"name\":\"timer\",\"cat\":\"timer\",\"ph\":\"f\",\"id\":\"%p\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f}", e.obj, tid, us(e.begin));
+						break;
+					case trace_kind::sweep:
+						fprintf(f, "{\"name\":\"sweep\",\"cat\":\"subsystem\",\"ph\":\"X\",\"pid\":1,\"tid\":%llu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"taken_in\":%u}}",
+							tid, us(e.begin), us(e.end) - us(e.begin), e.count);
+						break;
+					}
+				});
+			}
+			fprintf(f, "\n]}\n");
+		}
+	private:
+		double us(time t) const {
+			return std::chrono::duration<double, std::micro>(t - origin).count();
+		}
+		static void escape(FILE* f, const char* s) {
+			for (; *s; s++) {
+				if (*s == '"' || *s == '\\')
+					fputc('\\', f);
+				if ((unsigned char)*s >= 0x20)
+					fputc(*s, f);
+			}
+		}
+		static uint64_t threadId() {
+#if defined(_WIN32) || defined(_WIN64)
+			return GetCurrentThreadId();
+#elif __APPLE__ || __MACH__
+			uint64_t id = 0;
+			pthread_threadid_np(nullptr, &id);
+			return id;
+#else
+			return (uint64_t)syscall(SYS_gettid);
+#endif
+		}
+		std::mutex mutex;
+		std::vector<std::unique_ptr<trace_ring>> rings;
+		std::atomic<bool> enabled{ true };
+		time origin = Clock::now();
+	};
+	inline trace_log& GetTraceLog() {
+		static trace_log log;
+		return log;
+	}
+	inline void Trace(trace_kind kind, const void* obj, const void* ctx, const char* name, time begin, time end, uint32_t count = 0) {
+		trace_log& log = GetTraceLog();
+		if (log.isEnabled())
+			log.local().record({ kind, count, obj, ctx, name, begin, end });
+	}
+	// Names the calling thread in the trace
+	inline void SetTraceThreadName(const char* name) {
+		GetTraceLog().local().name.store(name, std::memory_order_relaxed);
+	}
+	/// <summary>
+	/// Writes the trace of every thread to a file, see trace_log::write. Only available when MULTI_TRACE is defined.
+	/// </summary>
+	/// <returns>False when the file could not be opened</returns>
+	inline bool WriteTrace(const char* path) {
+		FILE* f = fopen(path, "w");
+		if (!f)
+			return false;
+		GetTraceLog().write(f);
+		fclose(f);
+		return true;
+	}
+#endif
+	typedef bool (*object_runner)(mobj*,runner*);
+	typedef bool (*runner_func)(runner*);
+	struct mobj {
+		friend class multi::runner;
+		friend class multi::timer_wheel;
+		friend class multi::runner_pool;
+		friend class multi::task_table;
+		std::chrono::time_point<std::chrono::high_resolution_clock> creation = Clock::now();
+		node<mobj>* tid = nullptr;
+		const char* type;
+		void* obj = nullptr;
+		void* data = nullptr;
+		mobj(const char* t) {
+			run = nullptr;
+			type = t;
+		}
+		object_runner run = nullptr;
+		// Universal methods
+		long long getTimeSinceCreation() const {
+			return std::chrono::duration_cast<milliseconds>(Clock::now() - creation).count();
+		}
+		priority getPriority() const {
+			return prio;
+		}
+		// Paused objects are skipped by the schedulers, change it with runner::setActive
+		bool isActive() const {
+			return active;
+		}
+	private:
+		std::atomic<bool> active{ true }; // Mirrored by the task table, see task_table::setActive. A pool's workers read it while others set it
+		runner* ref = nullptr;
+		priority prio = priority::normal;
+		size_t slot = SIZE_MAX; // Index in the runner's task_table, SIZE_MAX when it is not in one
+		std::atomic<bool> ready{ false };
+		bool armed = false; // Set while the subsystem or the ready queue holds the object, only touched by the runner's thread
+		bool timed = false; // Alarms and tloops, these are not in the task tables and only run when their timer hands them back
+		bool frame = false; // The hiddendata is a coroutine frame that the runner destroys together with the object
+		bool timer = false; // Alarms, tloops and tsteps, the ones that can be cancelled and reset
+		bool moved = false; // Reset while the subsystem held it, it may come back due for the old deadline. Only touched by the runner's thread
+		std::atomic<bool> cancelled{ false }; // The subsystem hands it back instead of keeping it
+		std::atomic<uint8_t> commanded{ 0 }; // 0, command_queued or command_dirty, see runner::command
+		bool heap = false; // Made by another thread than the runner's, so the block comes from the heap and not from the slab
+		std::atomic<uint8_t> remote{ 0 }; // queued_bit, retired_bit and moved_bit, see runner::destroy and runner::setPriority
+		std::atomic<priority> wanted{ priority::normal }; // The level to move to once moved_bit is taken in
+		uint64_t retired = 0; // The epoch it was destroyed in
+		void* hiddendata = nullptr; // This is the event function pointer for all mobjs
+		std::atomic<mobj*> qnext{ nullptr }; // Link for the timeQueue
+		std::atomic<mobj*> snext{ nullptr }; // Link for handing the object over to another thread
+		std::atomic<mobj*> cnext{ nullptr }; // Link for the commands queue
+		// Timing wheel links, only touched by the subsystem
+		mobj* wnext = nullptr;
+		mobj* wprev = nullptr;
+		uint64_t wexpire = 0;
+		uint16_t wslot = 0;
+		bool wheeled = false;
+#ifdef MULTI_STATS
+	public:
+		task_stats* stats = nullptr;
+#endif
+	};
+	// Runs an object, with MULTI_STATS defined this also records how long it took and with MULTI_TRACE it leaves a run event
+	inline bool RunObject(mobj* m, runner* r) {
+#if defined(MULTI_STATS) || defined(MULTI_TRACE)
+#ifdef MULTI_STATS
+		task_stats* stats = m->stats; // The run may destroy the object
+#endif
+#ifdef MULTI_TRACE
+		const char* type = m->type;
+#endif
+		auto begin = Clock::now();
+		bool result = m->run(m, r);
+		auto end = Clock::now();
+#ifdef MULTI_STATS
+		auto d = std::chrono::duration_cast<nanoseconds>(end - begin).count();
+		stats->runtime.record(d > 0 ? (uint64_t)d : 0);
+#endif
+#ifdef MULTI_TRACE
+		Trace(trace_kind::run, m, r, type, begin, end);
+#endif
+		return result;
+#else
+		return m->run(m, r);
+#endif
+	}
+	/// <summary>
+	/// Dense storage for the tasks of one priority level. The fields a pass needs are kept in their own arrays so a pass walks memory
+	/// in order instead of chasing pointers. The mobj is the stable handle, it keeps track of its own index. Removing swaps the last task
+	/// into the hole, so adding, removing and counting are all O(1). The active flag is mirrored here, so it may only be changed through
+	/// runner::setActive. The run function is read from the object on every run, the same way RunObject does it.
+	/// </summary>
+	class task_table {
+	public:
+		inline size_t size() const {
+			return objs.size();
+		}
+		inline bool empty() const {
+			return objs.empty();
+		}
+		void add(mobj* m) {
+			m->slot = objs.size();
+			objs.push_back(m);
+			active.push_back(m->active);
+			activeCount += m->active ? 1 : 0;
+		}
+		void remove(mobj* m) {
+			size_t i = m->slot;
+			size_t last = objs.size() - 1;
+			activeCount -= active[i] ? 1 : 0;
+			if (i != last) {
+				objs[i] = objs[last];
+				active[i] = active[last];
+				objs[i]->slot = i;
+			}
+			objs.pop_back();
+			active.pop_back();
+			m->slot = SIZE_MAX;
+		}
+		void setActive(mobj* m, bool a) {
+			m->active = a;
+			if ((active[m->slot] != 0) != a)
+				activeCount += a ? 1 : (size_t)-1;
+			active[m->slot] = a;
+		}
+		// Number of tasks the schedulers would run
+		inline size_t getActiveCount() const {
+			return activeCount;
+		}
+		inline bool isActive(size_t i) const {
+			return active[i] != 0;
+		}
+		inline mobj* at(size_t i) const {
+			return objs[i];
+		}
+		// Runs the task at index i if it is active
+		inline void run(size_t i, runner* r) const {
+			if (active[i])
+				RunObject(objs[i], r);
+		}
+	private:
+		std::vector<uint8_t> active;
+		std::vector<mobj*> objs;
+		size_t activeCount = 0;
+	};
+	// Keeps track of time.
+	template <typename T>
+	struct timer {
+		inline void start() {
+			t = Clock::now();
+		}
+		inline long long get() const {
+			return std::chrono::duration_cast<T>(Clock::now() - t).count();
+		}
+		// The point in time that is s units after the timer was started
+		inline time deadline(long long s) const {
+			return t + T(s);
+		}
+		inline void sleep(long long s) {
+			std::this_thread::sleep_for(T(s));
+		}
+	private:
+		time t;
+	};
+	/// <summary>
+	/// Timer state of a timed object. The unit is resolved when the object is made, so the deadline is a plain time point
+	/// and checking it is a single compare.
+	/// </summary>
+	struct timed_state {
+		std::atomic<time> deadline{ time() }; // Read by the subsystem, the runner may move it while the subsystem holds the object, see runner::reset
+		Clock::duration period = Clock::duration::zero();
+		template<typename T>
+		inline void setPeriod(long long s) {
+			period = std::chrono::duration_cast<Clock::duration>(T(s));
+		}
+		// Starts counting down from now
+		inline void start() {
+			start(Clock::now());
+		}
+		inline void start(time now) {
+			deadline.store(now + period, std::memory_order_relaxed);
+		}
+		inline time due() const {
+			return deadline.load(std::memory_order_relaxed);
+		}
+		inline bool expired(time now) const {
+			return due() <= now;
+		}
+	};
+	// Where a step or an updater is at
+	struct step_state {
+		int start = 0;
+		int end = 0;
+		int count = 1;
+		int current = 0;
+		uint32_t skip = 0; // Updaters run once every skip + 1 passes
+		uint32_t left = 0;
+		double cost = 0; // Measured nanoseconds per iteration of a step, 0 until the first pass
+	};
+	// Everything a runner allocates for one object, kept together in one cache line aligned block
+	struct alignas(64) mobj_block {
+		mobj obj; // Must stay the first member, the block is found from the object's address
+		node<mobj> link;
+		timed_state clock;
+		step_state step;
+		channel_waiter* waiter = nullptr; // The channel a receiver takes its messages from and parks on, nullptr for everything else
+		uint32_t batch = 0; // Messages a receiver handles per run
+		uint32_t worker = 0; // The runner_pool worker whose wheel keeps a timed object, they are never stolen
+		mobj_block(const char* t) : obj(t) {}
+	};
+	/// <summary>
+	/// Hierarchical timing wheel that holds the timed objects of a runner.
+	/// Every level has 64 slots and a slot on level n spans 64^n ticks of one microsecond. Timers are stored in an intrusive list
+	/// inside of the mobj, so inserting and cancelling is O(1). Advancing the wheel jumps straight to the next occupied slot using
+	/// a bitmap per level, so a sweep only costs something when timers are actually due (or need to be moved down a level).
+	/// Deadlines further out than the top level (~51 days) are parked in the top level and re-filed when their slot comes around.
+	/// </summary>
+	class timer_wheel {
+	public:
+		typedef microseconds resolution;
+		static constexpr int levels = 7;
+		static constexpr int slot_bits = 6;
+		static constexpr uint64_t slots = 1ULL << slot_bits;
+		static constexpr uint64_t slot_mask = slots - 1;
+		timer_wheel(time b = Clock::now()) : base(b) {}
+		timer_wheel(const timer_wheel&) = delete;
+		timer_wheel& operator=(const timer_wheel&) = delete;
+		/// <summary>
+		/// Adds an object to the wheel, it expires once the clock has passed the deadline. Deadlines are rounded up to the next tick,
+		/// so an object is never considered expired early. Deadlines in the past expire on the next advance.
+		/// </summary>
+		void insert(mobj* m, time deadline) {
+			if (m->wheeled)
+				cancel(m);
+			m->wexpire = ticksCeil(deadline);
+			file(m);
+			count++;
+		}
+		/// <summary>
+		/// Removes an object from the wheel without it expiring
+		/// </summary>
+		/// <returns>False if the object was not in the wheel</returns>
+		bool cancel(mobj* m) {
+			if (!m->wheeled)
+				return false;
+			unlink(m);
+			count--;
+			return true;
+		}
+		/// <summary>
+		/// Moves the wheel forward to now and calls expired(mobj*) for every object whose deadline has passed.
+		/// Expired objects are no longer in the wheel when the callback is called, so they can be inserted again.
+		/// </summary>
+		/// <returns>The number of objects that expired</returns>
+		template<typename F>
+		size_t advance(time now, F&& expired) {
+			uint64_t target = ticksFloor(now);
+			size_t n = expire(overdue, expired);
+			while (count && cur <= target) {
+				uint64_t t = nextTick();
+				if (t > target)
+					break;
+				cur = t;
+				cascade(t);
+				uint16_t slot = (uint16_t)(t & slot_mask);
+				bitmap[0] &= ~(1ULL << slot);
+				n += expire(slot, expired);
+				cur = t + 1;
+			}
+			if (cur <= target)
+				cur = target + 1;
+			return n;
+		}
+		/// <summary>
+		/// Gets the earliest tick at which the wheel has work to do, this is either an expiring slot or a slot that has to be moved down a level
+		/// </summary>
+		/// <returns>False if the wheel is empty</returns>
+		bool nextEvent(time& t) const {
+			if (!count)
+				return false;
+			t = base + resolution(nextTick());
+			return true;
+		}
+		size_t size() const {
+			return count;
+		}
+		bool empty() const {
+			return count == 0;
+		}
+	private:
+		time base;
+		uint64_t cur = 0; // The next tick that has not been processed yet
+		size_t count = 0;
+		static constexpr uint16_t overdue = levels * slots; // Objects that were already due when they were inserted
+		uint64_t bitmap[levels] = {};
+		mobj* heads[levels * slots + 1] = {};
+		inline uint64_t ticksFloor(time t) const {
+			if (t <= base)
+				return 0;
+			return (uint64_t)std::chrono::duration_cast<resolution>(t - base).count();
+		}
+		inline uint64_t ticksCeil(time t) const {
+			if (t <= base)
+				return 0;
+			auto d = std::chrono::duration_cast<resolution>(t - base);
+			if (base + d < t)
+				d += resolution(1);
+			return (uint64_t)d.count();
+		}
+		static inline uint64_t rotr(uint64_t v, uint64_t r) {
+			return (v >> r) | (v << ((slots - r) & slot_mask));
+		}
+		// Unlinks a whole slot and hands every object in it to expired
+		template<typename F>
+		size_t expire(uint16_t slot, F& expired) {
+			mobj* m = heads[slot];
+			heads[slot] = nullptr;
+			size_t n = 0;
+			while (m) {
+				mobj* next = m->wnext;
+				m->wnext = m->wprev = nullptr;
+				m->wheeled = false;
+				count--;
+				n++;
+				expired(m);
+				m = next;
+			}
+			return n;
+		}
+		// Finds the level and slot for an object relative to cur and links it in
+		void file(mobj* m) {
+			if (m->wexpire < cur) {
+				link(m, overdue);
+				return;
+			}
+			uint64_t delta = m->wexpire - cur;
+			int level = delta < slots ? 0 : highest_bit(delta) / slot_bits;
+			uint64_t e = m->wexpire;
+			if (level >= levels) {
+				level = levels - 1;
+				e = cur + (1ULL << (levels * slot_bits)) - 1; // Too far out, park it in the top level
+			}
+			uint64_t idx = (e >> (level * slot_bits)) & slot_mask;
+			link(m, (uint16_t)(level * slots + idx));
+			bitmap[level] |= 1ULL << idx;
+		}
+		void link(mobj* m, uint16_t slot) {
+			m->wslot = slot;
+			m->wprev = nullptr;
+			m->wnext = heads[slot];
+			if (m->wnext)
+				m->wnext->wprev = m;
+			heads[slot] = m;
+			m->wheeled = true;
+		}
+		void unlink(mobj* m) {
+			if (m->wprev)
+				m->wprev->wnext = m->wnext;
+			else
+				heads[m->wslot] = m->wnext;
+			if (m->wnext)
+				m->wnext->wprev = m->wprev;
+			if (!heads[m->wslot] && m->wslot != overdue)
+				bitmap[m->wslot / slots] &= ~(1ULL << (m->wslot & slot_mask));
+			m->wnext = m->wprev = nullptr;
+			m->wheeled = false;
+		}
+		// The earliest tick >= cur that has something in it
+		uint64_t nextTick() const {
+			uint64_t best = UINT64_MAX;
+			if (heads[overdue])
+				return cur;
+			if (bitmap[0])
+				best = cur + lowest_bit(rotr(bitmap[0], cur & slot_mask));
+			for (int level = 1; level < levels; level++) {
+				if (!bitmap[level])
+					continue;
+				int shift = level * slot_bits;
+				uint64_t q = (cur + (1ULL << shift) - 1) >> shift; // The first slot boundary at or after cur
+				uint64_t t = (q + lowest_bit(rotr(bitmap[level], q & slot_mask))) << shift;
+				if (t < best)
+					best = t;
+			}
+			return best;
+		}
+		// Moves the objects of every level whose slot boundary is at t down into the lower levels, highest level first
+		void cascade(uint64_t t) {
+			int top = t ? lowest_bit(t) / slot_bits : levels - 1;
+			if (top >= levels)
+				top = levels - 1;
+			for (int level = top; level > 0; level--) {
+				uint64_t idx = (t >> (level * slot_bits)) & slot_mask;
+				uint16_t slot = (uint16_t)(level * slots + idx);
+				mobj* m = heads[slot];
+				if (!m)
+					continue;
+				heads[slot] = nullptr;
+				bitmap[level] &= ~(1ULL << idx);
+				while (m) {
+					mobj* next = m->wnext;
+					file(m);
+					m = next;
+				}
+			}
+		}
 	};
-	// End queue
-	typedef bool (*object_runner)(mobj*,runner*);
-	typedef bool (*runner_func)(runner*);
-	struct mobj {
-		friend class multi::runner;
-		std::chrono::time_point<std::chrono::high_resolution_clock> creation = Clock::now();
-		bool active = true;
-		node<mobj>* tid = nullptr;
-		const char* type;
-		void* obj = nullptr;
-		void* data = nullptr;
-		mobj(const char* t) {
-			run = nullptr;
-			type = t;
+#ifdef __cpp_impl_coroutine
+	/// <summary>
+	/// Hands out the coroutine frames of a runner. Sizes are rounded up to 64 bytes and finished frames are kept in a free list per size,
+	/// so a coroutine of a size that ran before does not go to the heap. Frames over 1kb always come from the heap.
+	/// The free lists belong to the runner's thread, only that thread gets frames from the pool, see GetFramePool. A frame that is
+	/// released by another thread goes onto a returned list that the runner's thread takes back the next time a list runs dry.
+	/// </summary>
+	class frame_pool {
+	public:
+		frame_pool(const std::atomic<std::thread::id>* owner) : owner_(owner) {}
+		frame_pool(const frame_pool&) = delete;            // disable copying
+		frame_pool& operator=(const frame_pool&) = delete; // disable assignment
+		~frame_pool() {
+			reclaim();
+			for (auto& f : free_)
+				while (f) {
+					free_frame* next = f->next;
+					::operator delete(f);
+					f = next;
+				}
 		}
-		object_runner run = nullptr;
-		// Universal methods
-		long long getTimeSinceCreation() const {
-			return std::chrono::duration_cast<milliseconds>(Clock::now() - creation).count();
+		// Only on the runner's thread
+		void* allocate(size_t bytes) {
+			size_t c = sizeClass(bytes);
+			if (c >= Classes)
+				return ::operator new(bytes);
+			if (!free_[c] && returned_.load(std::memory_order_relaxed))
+				reclaim();
+			if (free_frame* f = free_[c]) {
+				free_[c] = f->next;
+				return f;
+			}
+			allocations_++;
+			return ::operator new((c + 1) * Granule);
+		}
+		// From any thread
+		void release(void* p, size_t bytes) {
+			size_t c = sizeClass(bytes);
+			if (c >= Classes) {
+				::operator delete(p);
+				return;
+			}
+			free_frame* f = static_cast<free_frame*>(p);
+			f->size = c;
+			if (isOwner()) {
+				f->next = free_[c];
+				free_[c] = f;
+				return;
+			}
+			f->next = returned_.load(std::memory_order_relaxed);
+			while (!returned_.compare_exchange_weak(f->next, f, std::memory_order_release, std::memory_order_relaxed)) {}
+		}
+		inline bool isOwner() const {
+			return owner_->load(std::memory_order_relaxed) == std::this_thread::get_id();
+		}
+		// The number of times the pool had to go to the heap
+		size_t getAllocationCount() const {
+			return allocations_;
 		}
 	private:
-		runner* ref = nullptr;
-		bool ready = false;
-		void* hiddendata = nullptr; // This is the event function pointer for all mobjs
-		void* reserved1 = nullptr; // For all objects dealing with time, this is a timer object pointer
-		void* reserved2 = nullptr; // For all objects dealing with time, this is a long long pointer
-		void* reserved3 = nullptr; // For all objects dealing with time, this is a char enum type for the type of time being kept
+		static constexpr size_t Granule = 64;
+		static constexpr size_t Classes = 16;
+		static size_t sizeClass(size_t bytes) {
+			return bytes ? (bytes - 1) / Granule : 0;
+		}
+		struct free_frame {
+			free_frame* next;
+			size_t size; // The size class, frames on the returned list are mixed
+		};
+		// Sorts the frames other threads gave back into the free lists
+		void reclaim() {
+			free_frame* f = returned_.exchange(nullptr, std::memory_order_acquire);
+			while (f) {
+				free_frame* next = f->next;
+				f->next = free_[f->size];
+				free_[f->size] = f;
+				f = next;
+			}
+		}
+		free_frame* free_[Classes] = {};
+		std::atomic<free_frame*> returned_{ nullptr };
+		size_t allocations_ = 0;
+		const std::atomic<std::thread::id>* owner_;
 	};
-	// Keeps track of time.
-	template <typename T>
-	struct timer {
-		inline void start() {
-			t = Clock::now();
+	inline frame_pool* GetFramePool(runner& r);
+	/// <summary>
+	/// A coroutine that runs on a runner. Hand it to runner::newTask and it starts on the runner's next pass. Inside it can
+	/// co_await run.sleep&lt;T&gt;(n) and run.next_pass(), a suspended task is not looked at until its timer or the next pass hands it back.
+	/// When the runner is the first parameter of the coroutine (after the lambda itself for lambdas) the frame comes from the runner's frame_pool, as long as the coroutine is called on the runner's thread.
+	/// </summary>
+	class task {
+	public:
+		struct promise_type {
+			mobj* self = nullptr;
+			task get_return_object() {
+				return task(std::coroutine_handle<promise_type>::from_promise(*this));
+			}
+			std::suspend_always initial_suspend() noexcept {
+				return {};
+			}
+			std::suspend_always final_suspend() noexcept {
+				return {}; // The runner destroys the frame once it sees the task is done
+			}
+			void return_void() {}
+			void unhandled_exception() {
+				std::terminate();
+			}
+			template<typename... Args>
+			static void* operator new(size_t size, runner& r, Args&...) {
+				return allocate(size, GetFramePool(r));
+			}
+			template<typename C, typename... Args>
+			static void* operator new(size_t size, C&, runner& r, Args&...) {
+				return allocate(size, GetFramePool(r));
+			}
+			static void* operator new(size_t size) {
+				return allocate(size, nullptr);
+			}
+			static void operator delete(void* p, size_t size) {
+				header* h = static_cast<header*>(p) - 1;
+				if (h->pool)
+					h->pool->release(h, size + sizeof(header));
+				else
+					::operator delete(h);
+			}
+		private:
+			// Sits in front of the frame and remembers where it came from
+			struct alignas(16) header {
+				frame_pool* pool;
+			};
+			static void* allocate(size_t size, frame_pool* pool) {
+				header* h = static_cast<header*>(pool ? pool->allocate(size + sizeof(header)) : ::operator new(size + sizeof(header)));
+				h->pool = pool;
+				return h + 1;
+			}
+		};
+		task(task&& other) noexcept : handle(other.handle) {
+			other.handle = nullptr;
 		}
-		inline long long get() const {
-			return std::chrono::duration_cast<T>(Clock::now() - t).count();
+		task(const task&) = delete;
+		task& operator=(const task&) = delete;
+		~task() {
+			if (handle)
+				handle.destroy(); // Never given to a runner
 		}
-		inline void sleep(long long s) {
-			std::this_thread::sleep_for(T(s));
+	private:
+		friend class runner;
+		explicit task(std::coroutine_handle<promise_type> h) : handle(h) {}
+		std::coroutine_handle<promise_type> handle;
+	};
+#endif
+	// Threads that wait for a future park on one of these, picked by the address of the future's state
+	struct park_slot {
+		std::mutex mutex;
+		std::condition_variable cond;
+	};
+	inline park_slot& ParkSlot(const void* p) {
+		static park_slot slots[16];
+		return slots[(reinterpret_cast<uintptr_t>(p) >> 6) & 15];
+	}
+	/// <summary>
+	/// A call that is handed to a runner or a pool, see runner::async. This is all the runner sees of it
+	/// </summary>
+	struct async_base {
+		std::atomic<async_base*> next{ nullptr }; // Link in the list of continuations of another call, and then in the queue of the runner that runs it
+		void* target = nullptr; // The runner or pool that runs it
+		void (*post)(void* target, async_base* a) = nullptr;
+		virtual void run() = 0;
+		virtual ~async_base() = default;
+		void submit() {
+			post(target, this);
+		}
+	};
+	// Where the result of a call is kept, nothing for void
+	template<typename R>
+	struct async_value {
+		alignas(R) unsigned char bytes[sizeof(R)];
+		bool set = false;
+		template<typename F>
+		void store(F& f) {
+			new (bytes) R(f());
+			set = true;
+		}
+		R& get() {
+			return *reinterpret_cast<R*>(bytes);
+		}
+		~async_value() {
+			if (set)
+				get().~R();
+		}
+	};
+	// A reference result is kept as a pointer to what the call returned
+	template<typename R>
+	struct async_value<R&> {
+		R* ptr = nullptr;
+		template<typename F>
+		void store(F& f) {
+			ptr = &f();
+		}
+		R& get() {
+			return *ptr;
+		}
+	};
+	template<>
+	struct async_value<void> {
+		template<typename F>
+		void store(F& f) {
+			f();
+		}
+		void get() {}
+	};
+	/// <summary>
+	/// The state a call shares with its future, the call, its result and the list of continuations are in a single allocation.
+	/// It is freed once the call has run and the future is gone.
+	/// </summary>
+	template<typename R>
+	class async_state : public async_base {
+	public:
+		void retain() {
+			refs_.fetch_add(1, std::memory_order_relaxed);
+		}
+		void release() {
+			if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				delete this;
+		}
+		bool isReady() const {
+			return ready_.load(std::memory_order_acquire);
+		}
+		// Yields for a moment and then parks the thread until the call is done
+		void wait() {
+			for (int i = 0; i < 64 && !isReady(); i++)
+				std::this_thread::yield();
+			if (isReady())
+				return;
+			park_slot& slot = ParkSlot(this);
+			std::unique_lock<std::mutex> lock(slot.mutex);
+			waiting_.fetch_add(1, std::memory_order_seq_cst);
+			slot.cond.wait(lock, [this] { return ready_.load(std::memory_order_seq_cst); });
+			waiting_.fetch_sub(1, std::memory_order_relaxed);
+		}
+		// The result, or the exception the call threw
+		decltype(std::declval<async_value<R>&>().get()) value() {
+			if (error_)
+				std::rethrow_exception(error_);
+			return value_.get();
+		}
+		// Submits c once this call is done, right away if it is done already
+		void chain(async_base* c) {
+			async_base* old = continuations_.load(std::memory_order_acquire);
+			do {
+				if (old == done()) {
+					c->submit();
+					return;
+				}
+				c->next.store(old, std::memory_order_relaxed);
+			} while (!continuations_.compare_exchange_weak(old, c, std::memory_order_acq_rel, std::memory_order_acquire));
+		}
+	protected:
+		template<typename F>
+		void complete(F& f) {
+			try {
+				value_.store(f);
+			}
+			catch (...) {
+				error_ = std::current_exception(); // Kept for get(), it must not take down the thread that ran the call
+			}
+			ready_.store(true, std::memory_order_seq_cst);
+			if (waiting_.load(std::memory_order_seq_cst)) {
+				park_slot& slot = ParkSlot(this);
+				{ std::lock_guard<std::mutex> lock(slot.mutex); }
+				slot.cond.notify_all();
+			}
+			async_base* c = continuations_.exchange(done(), std::memory_order_acq_rel);
+			while (c) {
+				async_base* following = c->next.load(std::memory_order_relaxed); // Submitting reuses the link
+				c->submit();
+				c = following;
+			}
 		}
 	private:
-		time t;
+		static async_base* done() {
+			return reinterpret_cast<async_base*>(uintptr_t(1)); // Marks the list once the continuations have been submitted
+		}
+		std::atomic<int> refs_{ 2 }; // The future and the pending call
+		std::atomic<bool> ready_{ false };
+		std::atomic<int> waiting_{ 0 };
+		std::atomic<async_base*> continuations_{ nullptr };
+		async_value<R> value_;
+		std::exception_ptr error_;
+	};
+	template<typename R, typename F>
+	class async_call : public async_state<R> {
+	public:
+		explicit async_call(F&& f) : f_(std::move(f)) {}
+		void run() override {
+			this->complete(f_);
+			this->release();
+		}
+	private:
+		F f_;
+	};
+	// Calls a continuation with the result of the call it follows, or with nothing for void
+	template<typename R>
+	struct continue_with {
+		template<typename F>
+		static auto call(F& f, async_state<R>* prev) -> decltype(f(prev->value())) {
+			return f(prev->value());
+		}
+	};
+	template<>
+	struct continue_with<void> {
+		template<typename F>
+		static auto call(F& f, async_state<void>*) -> decltype(f()) {
+			return f();
+		}
+	};
+	// Runs f with the result of the call it follows, holds on to that call until it is destroyed
+	template<typename R, typename F>
+	struct continuation {
+		async_state<R>* prev;
+		F f;
+		continuation(async_state<R>* p, F&& fn) : prev(p), f(std::move(fn)) {
+			prev->retain();
+		}
+		continuation(continuation&& other) noexcept : prev(other.prev), f(std::move(other.f)) {
+			other.prev = nullptr;
+		}
+		~continuation() {
+			if (prev)
+				prev->release();
+		}
+		auto operator()() -> decltype(continue_with<R>::call(f, prev)) {
+			return continue_with<R>::call(f, prev);
+		}
+	};
+	/// <summary>
+	/// The result of runner::async or runner_pool::async. get() and wait() park the calling thread instead of spinning, never call them
+	/// on the thread of the runner that has to run the call. then() runs a function with the result once it is there, on any runner or pool.
+	/// When the call throws, get() rethrows the exception and every call chained after it with then() is skipped and throws it as well.
+	/// </summary>
+	template<typename R>
+	class future {
+	public:
+		future() = default;
+		explicit future(async_state<R>* state) : state_(state) {}
+		future(future&& other) noexcept : state_(other.state_) {
+			other.state_ = nullptr;
+		}
+		future& operator=(future&& other) noexcept {
+			if (this != &other) {
+				if (state_)
+					state_->release();
+				state_ = other.state_;
+				other.state_ = nullptr;
+			}
+			return *this;
+		}
+		future(const future&) = delete;
+		future& operator=(const future&) = delete;
+		~future() {
+			if (state_)
+				state_->release();
+		}
+		bool valid() const {
+			return state_ != nullptr;
+		}
+		bool ready() const {
+			return state_->isReady();
+		}
+		void wait() const {
+			state_->wait();
+		}
+		// Waits for the result, it stays owned by the future. Rethrows what the call threw
+		decltype(std::declval<async_state<R>&>().value()) get() {
+			state_->wait();
+			return state_->value();
+		}
+		/// <summary>
+		/// Runs f on target (a runner or runner_pool) once this call is done. f takes the result by reference, or nothing for void
+		/// </summary>
+		template<typename Target, typename F>
+		auto then(Target& target, F&& f) -> future<decltype(std::declval<continuation<R, typename std::decay<F>::type>&>()())> {
+			return chain(&target, &Target::postAsync, std::forward<F>(f));
+		}
+		// Runs f where this call ran
+		template<typename F>
+		auto then(F&& f) -> future<decltype(std::declval<continuation<R, typename std::decay<F>::type>&>()())> {
+			return chain(state_->target, state_->post, std::forward<F>(f));
+		}
+	private:
+		template<typename F>
+		auto chain(void* target, void (*post)(void*, async_base*), F&& f) -> future<decltype(std::declval<continuation<R, typename std::decay<F>::type>&>()())> {
+			typedef continuation<R, typename std::decay<F>::type> C;
+			typedef decltype(std::declval<C&>()()) R2;
+			typename std::decay<F>::type fn(std::forward<F>(f));
+			auto call = new async_call<R2, C>(C(state_, std::move(fn)));
+			call->target = target;
+			call->post = post;
+			state_->chain(call);
+			return future<R2>(call);
+		}
+		async_state<R>* state_ = nullptr;
+	};
+	// A free object block for threads other than the runner's, see runner::newObject. The block is handed out right away, the node
+	// only comes back onto the stack once the epoch domain says nobody can be reading it anymore
+	struct spare_block {
+		std::atomic<spare_block*> next{ nullptr };
+		void* mem = nullptr;
+		uint64_t retired = 0;
 	};
 	class runner {
-		bool stop = false;
+		friend class multi::runner_pool;
+		std::atomic<bool> stop{ false };
 		scheduler scheme;
-		node<mobj> tasks;
+		task_table tasks[priority_count]; // One table per priority level
+		size_t cursor[priority_count] = {}; // Where the priority scheduler picks up each level on the next pass
+		uint64_t credit[priority_count] = {};
 		runner_func current;
 		bool initSubsystem() {
 			if (subsystem != nullptr)
 				return false; // Subsystem already initiated
 			subsystem = new std::thread([](multi::runner* r) {
-				node<mobj> timedObjects;
+				r->placeThread(r->threadOptions.subsystem, "runner subsystem"); // The wheel is built by this thread, so its memory lands on its node as well
+				timer_wheel timedObjects(r->now());
+				time next;
 				// The thread main loop
 				while (r->isActive()) {
-					// Take items from the queue and put them into timedObjects linked list
-					while (!r->timeQueue.empty()) { // What if we have 1 million alarms? This could hold things up couldn't it? But why would one do this?
-						timedObjects.addNode(r->timeQueue.pop());
+#if defined(MULTI_STATS) || defined(MULTI_TRACE)
+					auto woke = Clock::now();
+#endif
+#ifdef MULTI_TRACE
+					uint32_t taken = 0;
+#endif
+					// Take everything out of the queue in one go and put it into the timing wheel
+					mobj* temp = r->timeQueue.drain_all();
+					while (temp) {
+						mobj* following = r->timeQueue.next(temp);
+						if (temp->cancelled.load(std::memory_order_acquire))
+							r->readyQueue.push(temp); // Cancelled on its way in, ready is still false so the runner lets go of it
+						else
+							timedObjects.insert(temp, r->getDeadline(temp));
+						temp = following;
+#ifdef MULTI_TRACE
+						taken++;
+#endif
 					}
-					//Handle timed objects
-					node<mobj>* current = timedObjects.next;
-					while (current != nullptr) {
-						mobj* temp = current->data;
-						char t = *(r->getReserved3<char>(temp));
-						long long set = *(r->getReserved2<long long>(temp));
-						switch (t)
-						{
-						case _nanosecond:
-						{
-							auto tester = (r->getReserved1<timer<nanoseconds>>(temp));
-							if (tester->get() >= set) {
-								r->setReady(temp, true);
-								current->deleteNode(); // Remove this node then keep going
-							}
-							break;
-						}
-						case _microsecond:
-						{
-							auto tester = (r->getReserved1<timer<microseconds>>(temp));
-							if (tester->get() >= set) {
-								r->setReady(temp, true);
-								current->deleteNode(); // Remove this node then keep going
-							}
-							break;
-						}
-						case _millisecond:
-						{
-							auto tester = (r->getReserved1<timer<milliseconds>>(temp));
-							if (tester->get() >= set) {
-								r->setReady(temp, true);
-								current->deleteNode(); // Remove this node then keep going
-							}
-							break;
-						}
-						case _second:
-						{
-							auto tester = (r->getReserved1<timer<seconds>>(temp));
-							if (tester->get() >= set) {
-								r->setReady(temp, true);
-								current->deleteNode(); // Remove this node then keep going
-							}
-							break;
-						}
-						case _minute:
-						{
-							auto tester = (r->getReserved1<timer<minutes>>(temp));
-							if (tester->get() >= set) {
-								r->setReady(temp, true);
-								current->deleteNode(); // Remove this node then keep going
-							}
-							break;
-						}
-						case _hour:
-						{
-							auto tester = (r->getReserved1<timer<hours>>(temp));
-							if (tester->get() >= set) {
-								r->setReady(temp, true);
-								current->deleteNode(); // Remove this node then keep going
+					// Cancels and resets of objects in the wheel, the ones that are not in it are on their way in or already handed out
+					temp = r->commands.drain_all();
+					while (temp) {
+						mobj* following = r->commands.next(temp);
+						uint8_t seen;
+						do {
+							temp->commanded.exchange(command_queued, std::memory_order_acq_rel); // Sees what the runner did before it marked the command
+							if (timedObjects.cancel(temp)) {
+								if (temp->cancelled.load(std::memory_order_acquire))
+									r->readyQueue.push(temp);
+								else
+									timedObjects.insert(temp, r->getDeadline(temp));
 							}
-							break;
-						}
-						default:
-							// Invalid data passed, we should do something
-							break;
-						}
-						current = current->next;
+							seen = command_queued;
+							// The runner changed it again while we looked, otherwise this is the last time the subsystem touches it
+						} while (!temp->commanded.compare_exchange_strong(seen, 0, std::memory_order_acq_rel));
+						temp = following;
 					}
-					// Continue the loop here
-
-
+					// Only the objects that are due are touched, one reading of the clock for the whole sweep
+					time now = r->now();
+					timedObjects.advance(now, [r, now](mobj* temp) {
+#ifdef MULTI_TRACE
+						Trace(trace_kind::expire, temp, r, temp->type, r->getDeadline(temp), now);
+#endif
+						r->setReady(temp, true); // The last time the subsystem touches this object, it is handed to the runner's readyQueue
+					});
+#ifdef MULTI_STATS
+					r->sweep.record(ElapsedSince(woke));
+#endif
+#ifdef MULTI_TRACE
+					Trace(trace_kind::sweep, nullptr, r, "sweep", woke, Clock::now(), taken);
+#endif
+					// Sleep until the next deadline or until a new timed object is pushed. The slack lets timers that are close together fire on one wake up
+					auto commanded = [r] { return !r->commands.empty(); };
+					if (timedObjects.nextEvent(next))
+						r->timeQueue.wait_until(Clock::now() + (next - r->now()) + r->getTimerSlack(), commanded); // The wait needs a time of Clock, the source may drift from it
+					else
+						r->timeQueue.wait(commanded);
 				}
 				}, this);
 			return true; // Initiated the subsystem
 		}
-		std::thread* subsystem;
+		std::thread* subsystem = nullptr;
+		std::atomic<long long> slack{ 0 };
+		std::atomic<clock_source> clockSource{ clock_source::standard };
+		int numaNode = -1;
+		thread_options threadOptions;
 		bool isLocal = true;
+		// Run first by every thread the runner starts
+		void placeThread(const std::optional<priority>& p, const char* name) {
+#ifdef MULTI_TRACE
+			SetTraceThreadName(name);
+#else
+			(void)name;
+#endif
+			if (!threadOptions.affinity.empty())
+				SetAffinity(threadOptions.affinity);
+			else if (numaNode >= 0)
+				SetAffinityNode(numaNode);
+			if (p)
+				SetOsPriority(*p);
+		}
 		std::thread* threadedloop = nullptr;
 		static bool round_robin(runner* run) {
-			auto& n = run->getHead();
-			node<mobj>* current = n.next;
-			while (current != nullptr) {
-				current->data->run(current->data, run);
-				current = current->next;
+			run->passing = true;
+			for (size_t level = 0; level < priority_count; level++) {
+				task_table& t = run->tasks[level];
+				size_t n = t.size(); // Tasks added during the pass wait for the next one
+				for (size_t i = 0; i < n && i < t.size(); i++)
+					t.run(i, run);
+			}
+			run->passing = false;
+			return true;
+		}
+		// Runs every core and very_high task on every pass. Below that only the levels that have active tasks count: the highest of them
+		// runs fully and each one after it gets a quarter of the share of the one before, so a pass only touches a slice of the bulk tasks
+		// while the important ones come around again quickly. A level alone on the runner runs fully, nothing is held back for levels
+		// that have no work. A level picks up where it left off and carries over the share it did not use yet, so it is never starved.
+		static bool priority_based(runner* run) {
+			run->passing = true;
+			unsigned rank = 0; // Levels with work above the current one
+			for (size_t level = 0; level < priority_count; level++) {
+				task_table& t = run->tasks[level];
+				size_t count = t.size();
+				if (!count || !t.getActiveCount())
+					continue;
+				size_t todo = count;
+				if (level > (size_t)priority::very_high) {
+					uint64_t& credit = run->credit[level];
+					credit += ((uint64_t)count << 16) >> (2 * rank); // 16.16 fixed point
+					todo = (size_t)(credit >> 16);
+					if (todo > count)
+						todo = count;
+					credit -= (uint64_t)todo << 16;
+				}
+				rank++;
+				size_t current = run->cursor[level];
+				while (todo--) {
+					if (current >= t.size())
+						current = 0; // Wrap around
+					if (t.empty())
+						break;
+					t.run(current++, run);
+				}
+				run->cursor[level] = current;
+			}
+			run->passing = false;
+			return true;
+		}
+		slab<mobj_block> blocks;
+		node<mobj>* graveyard = nullptr; // Destroyed objects waiting to be taken out of the tasks and for the subsystem to let go of them, linked through their block's node
+		bool passing = false; // True while a scheduler is walking the tasks, removing then has to wait until the pass is over
+		bool pooled = false; // The objects are run by a runner_pool whose workers keep the timers themselves, so nothing goes through the timeQueue or the readyQueue
+		std::atomic<size_t> timedCount{ 0 }; // Other threads make timed objects too
+		// One go over everything, the scheduler reads current on every pass so it can be swapped while looping.
+		// Returns false when there was nothing to do
+		inline bool pass() {
+			bool busy = takeRemote();
+			busy |= runAsync();
+			busy |= dispatch();
+			current(this);
+			if (graveyard)
+				collect();
+#ifdef MULTI_STATS
+			passes.store(passes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+#endif
+			return busy || hasActiveTasks();
+		}
+		bool hasActiveTasks() const {
+			for (size_t level = 0; level < priority_count; level++)
+				if (tasks[level].getActiveCount())
+					return true;
+			return false;
+		}
+		// Passes until the runner is stopped, waiting as the idle policy says whenever a pass has nothing to do
+		void runLoop() {
+			const idle_policy p = idlePolicy;
+			uint64_t idle = 0;
+			while (!stop) {
+				if (pass()) {
+					idle = 0;
+					continue;
+				}
+				idle++;
+				if (idle <= p.spins)
+					CpuRelax();
+				else if (idle <= (uint64_t)p.spins + p.yields || !p.park)
+					std::this_thread::yield();
+				else {
+					park();
+					idle = 0;
+				}
+			}
+		}
+		// Sleeps until a timed object is due, a call comes in or wakeUp is called. The subsystem pushing into the readyQueue wakes us on its own
+		void park() {
+			parked.store(true, std::memory_order_seq_cst);
+			if (asyncQueue.empty() && remoteQueue.empty() && !hasActiveTasks() && !stop)
+				readyQueue.wait();
+			parked.store(false, std::memory_order_relaxed);
+		}
+		// Called after handing the runner something from another thread
+		inline void wakeUp() {
+			if (parked.load(std::memory_order_seq_cst))
+				readyQueue.wake();
+		}
+		std::atomic<bool> parked{ false };
+		idle_policy idlePolicy;
+		mpsc_queue<async_base, &async_base::next> asyncQueue;
+		bool runAsync() {
+			async_base* a = asyncQueue.drain_all();
+			bool ran = a != nullptr;
+			while (a) {
+				async_base* following = asyncQueue.next(a); // Running it may free it
+				a->run();
+				a = following;
+			}
+			return ran;
+		}
+		// Runs the timed objects that are due, everything else that is timed is never looked at
+		bool dispatch() {
+			mobj* m = readyQueue.drain_all();
+			bool ran = m != nullptr;
+			while (m) {
+				mobj* following = readyQueue.next(m);
+				if (m->timer && !takeDue(m)) {
+					m = following;
+					continue;
+				}
+				if (m->active) {
+#ifdef MULTI_STATS
+					auto late = std::chrono::duration_cast<nanoseconds>(now() - block(m)->clock.due()).count();
+					m->stats->lateness.record(late > 0 ? (uint64_t)late : 0);
+#endif
+#ifdef MULTI_TRACE
+					auto taken = Clock::now();
+					Trace(trace_kind::dispatch, m, this, m->type, taken, taken);
+#endif
+#if defined(MULTI_STATS) || defined(MULTI_TRACE)
+					RunObject(m, this);
+#else
+					m->run(m, this);
+#endif
+				}
+				else
+					m->armed = false; // Paused or destroyed, it stays ready until it is resumed
+				m = following;
+			}
+			return ran;
+		}
+		// Sorts out a timer that was cancelled or reset while it was away, false if it is not due after all
+		bool takeDue(mobj* m) {
+			if (m->cancelled.load(std::memory_order_relaxed)) {
+				m->ready = false;
+				m->armed = false; // Nobody holds it anymore, it can be reset or collected
+				return false;
+			}
+			if (m->moved) {
+				m->moved = false;
+				if (m->ready && block(m)->clock.due() > now())
+					m->ready = false; // Came due for the deadline it had before the reset
+			}
+			if (!m->ready) {
+				timeQueue.push(m); // Taken back by a reset, it goes in again with its new deadline
+				return false;
 			}
 			return true;
 		}
+		static constexpr uint8_t command_queued = 1; // In the commands queue or being looked at by the subsystem
+		static constexpr uint8_t command_dirty = 2; // Changed again while the subsystem was looking at it, it looks once more
+		// Has the subsystem take another look at a timer it holds. The memory of the object is not reused while a command is open
+		void command(mobj* m) {
+			uint8_t c = m->commanded.load(std::memory_order_relaxed);
+			while (c != command_dirty) {
+				if (m->commanded.compare_exchange_weak(c, c ? command_dirty : command_queued, std::memory_order_acq_rel)) {
+					if (!c) {
+						commands.push(m);
+						timeQueue.notify();
+					}
+					return;
+				}
+			}
+		}
+		// Moves the deadline of a timer that is armed
+		void retime(mobj* m, time deadline) {
+			block(m)->clock.deadline.store(deadline, std::memory_order_relaxed);
+			if (m->ready)
+				m->ready = false; // Waiting in the readyQueue, the dispatch sends it back in
+			else {
+				m->moved = true;
+				command(m);
+			}
+		}
+		static inline mobj_block* block(mobj* m) {
+			return reinterpret_cast<mobj_block*>(m);
+		}
+		// A block straight from the heap, aligned by hand the same way the slab does it. The pointer to free sits right in front of the block
+		static void* allocateHeapBlock() {
+			void* raw = ::operator new(sizeof(mobj_block) + alignof(mobj_block));
+			uintptr_t p = reinterpret_cast<uintptr_t>(raw) + sizeof(void*);
+			p = (p + alignof(mobj_block) - 1) & ~(uintptr_t)(alignof(mobj_block) - 1);
+			reinterpret_cast<void**>(p)[-1] = raw;
+			return reinterpret_cast<void*>(p);
+		}
+		static void freeHeapBlock(void* b) {
+			::operator delete(reinterpret_cast<void**>(b)[-1]);
+		}
+		// The slab belongs to the runner's thread, other threads take one of the spare blocks it put aside and go to the heap when there is none
+		mobj* newObject(const char* type) {
+			bool local = isOwner();
+			void* mem = local ? blocks.allocate() : takeSpare();
+			bool heap = mem == nullptr;
+			if (heap)
+				mem = allocateHeapBlock();
+			auto b = new (mem) mobj_block(type);
+			b->obj.ref = this;
+			b->obj.heap = heap;
+#ifdef MULTI_STATS
+			b->obj.stats = acquireStats(&b->obj, local);
+#endif
+			return &b->obj;
+		}
+		// Whether the calling thread is the one that runs the runner. Before it loops that is the thread that made it
+		inline bool isOwner() const {
+			return owner.load(std::memory_order_relaxed) == std::this_thread::get_id();
+		}
+		std::atomic<std::thread::id> owner{ std::this_thread::get_id() };
+		static constexpr uint8_t queued_bit = 1; // In the remoteQueue
+		static constexpr uint8_t retired_bit = 2; // Destroyed by another thread
+		static constexpr uint8_t moved_bit = 4; // Has to move to the level in wanted
+		mpsc_queue<mobj, &mobj::snext> remoteQueue; // Objects other threads added or destroyed, taken in at the start of a pass
+		bool takeRemote() {
+			mobj* m = remoteQueue.drain_all();
+			bool took = m != nullptr;
+			while (m) {
+				mobj* following = remoteQueue.next(m);
+				// From here on a destroy or a move from another thread pushes it again
+				uint8_t bits = m->remote.fetch_and((uint8_t)~(queued_bit | moved_bit), std::memory_order_acq_rel);
+				if (bits & retired_bit)
+					retire(m);
+				else {
+					if (bits & moved_bit)
+						moveTask(m, m->wanted.load(std::memory_order_relaxed));
+					if (m->slot == SIZE_MAX && !m->timed)
+						tasks[(size_t)m->prio].add(m); // Made by another thread, the rest was only moved
+				}
+				m = following;
+			}
+			if (sparesWanted.load(std::memory_order_relaxed))
+				refillSpares();
+			return took;
+		}
+		static constexpr size_t spare_target = 64;
+		std::atomic<spare_block*> spares{ nullptr }; // Blocks for other threads, a lock-free stack
+		std::atomic<size_t> spareCount{ 0 };
+		std::atomic<bool> sparesWanted{ false };
+		mpsc_queue<spare_block, &spare_block::next> usedSpares; // Nodes other threads took the block out of
+		std::vector<spare_block*> limbo; // Used nodes another thread could still be reading, oldest first
+		std::vector<spare_block*> freeSpares;
+		void* takeSpare() {
+			epoch_guard guard; // Keeps the nodes we look at from coming back onto the stack, so the compare exchange can not be fooled
+			spare_block* s = spares.load(std::memory_order_acquire);
+			while (s && !spares.compare_exchange_weak(s, s->next.load(std::memory_order_relaxed), std::memory_order_acquire, std::memory_order_acquire));
+			if (!s) {
+				sparesWanted.store(true, std::memory_order_relaxed);
+				return nullptr;
+			}
+			if (spareCount.fetch_sub(1, std::memory_order_relaxed) <= spare_target / 2)
+				sparesWanted.store(true, std::memory_order_relaxed);
+			void* mem = s->mem;
+			usedSpares.push(s);
+			return mem;
+		}
+		// Tops the spare blocks up, nodes are only reused once the epoch says nobody can be reading them
+		void refillSpares() {
+			sparesWanted.store(false, std::memory_order_relaxed);
+			epoch_domain& epochs = GetEpochDomain();
+			uint64_t epoch = epochs.current();
+			spare_block* used = usedSpares.drain_all();
+			while (used) {
+				spare_block* following = usedSpares.next(used);
+				used->retired = epoch;
+				limbo.push_back(used);
+				used = following;
+			}
+			uint64_t now = epochs.advance();
+			size_t safe = 0;
+			while (safe < limbo.size() && epoch_domain::isSafe(limbo[safe]->retired, now))
+				safe++;
+			freeSpares.insert(freeSpares.end(), limbo.begin(), limbo.begin() + safe);
+			limbo.erase(limbo.begin(), limbo.begin() + safe);
+			size_t have = spareCount.load(std::memory_order_relaxed);
+			if (have >= spare_target)
+				return;
+			spare_block* first = nullptr;
+			spare_block* last = nullptr;
+			for (size_t i = have; i < spare_target; i++) {
+				spare_block* n;
+				if (freeSpares.empty())
+					n = new spare_block;
+				else {
+					n = freeSpares.back();
+					freeSpares.pop_back();
+				}
+				n->mem = blocks.allocate();
+				n->next.store(first, std::memory_order_relaxed);
+				first = n;
+				if (!last)
+					last = n;
+			}
+			spareCount.fetch_add(spare_target - have, std::memory_order_relaxed);
+			spare_block* head = spares.load(std::memory_order_relaxed);
+			do {
+				last->next.store(head, std::memory_order_relaxed);
+			} while (!spares.compare_exchange_weak(head, first, std::memory_order_release, std::memory_order_relaxed));
+		}
+#ifdef MULTI_STATS
+		std::atomic<task_stats*> statsHead{ nullptr }; // Every stats entry this runner made, readers walk this list from any thread
+		task_stats* freeStats = nullptr;
+		std::atomic<uint64_t> passes{ 0 };
+		time created = Clock::now();
+		runner_histogram sweep;
+		task_stats* acquireStats(const mobj* owner, bool local) {
+			task_stats* s = local ? freeStats : nullptr; // The free list belongs to the runner's thread
+			if (s) {
+				freeStats = s->nextFree;
+				s->runtime.reset();
+				s->lateness.reset();
+			}
+			else {
+				s = new task_stats;
+				task_stats* head = statsHead.load(std::memory_order_relaxed);
+				do {
+					s->nextStats = head;
+				} while (!statsHead.compare_exchange_weak(head, s, std::memory_order_release, std::memory_order_relaxed));
+			}
+			s->type.store(owner->type, std::memory_order_relaxed);
+			s->owner.store(owner, std::memory_order_release);
+			return s;
+		}
+		void releaseStats(task_stats* s) {
+			s->owner.store(nullptr, std::memory_order_release);
+			s->nextFree = freeStats;
+			freeStats = s;
+		}
+#endif
+		inline void addTask(mobj* obj) {
+			if (isOwner()) {
+				tasks[(size_t)obj->prio].add(obj);
+				return;
+			}
+			obj->remote.fetch_or(queued_bit, std::memory_order_relaxed);
+			remoteQueue.push(obj);
+			wakeUp();
+		}
+		inline void removeTask(mobj* obj) {
+			tasks[(size_t)obj->prio].remove(obj);
+		}
+		// Files a task under another level, only on the runner's thread while no pass walks the tasks
+		void moveTask(mobj* m, priority p) {
+			if (m->prio == p)
+				return;
+			if (m->slot != SIZE_MAX) {
+				removeTask(m);
+				m->prio = p;
+				tasks[(size_t)p].add(m);
+			}
+			else
+				m->prio = p;
+		}
+		inline void arm(mobj* obj) {
+			obj->armed = true;
+			if (!pooled)
+				timeQueue.push(obj); // A pool worker files it in its own wheel once the run is over
+		}
+		// Gives the memory of destroyed objects back once the subsystem is done with them
+		void collect() {
+			node<mobj>** link = &graveyard;
+			while (*link) {
+				node<mobj>* n = *link;
+				mobj* m = n->data;
+				if (m->slot != SIZE_MAX)
+					removeTask(m);
+				if (m->armed || m->commanded.load(std::memory_order_acquire)) {
+					link = &n->next; // Still waiting on its timer
+					continue;
+				}
+				*link = n->next;
+				freeObject(m);
+			}
+		}
+		// Gives the memory of an object that nothing holds anymore back, on the runner's thread
+		void freeObject(mobj* m) {
+#ifdef __cpp_impl_coroutine
+			if (m->frame)
+				std::coroutine_handle<>::from_address(m->hiddendata).destroy();
+#endif
+#ifdef MULTI_STATS
+			releaseStats(m->stats);
+#endif
+			mobj_block* b = block(m);
+			bool heap = m->heap;
+			b->~mobj_block();
+			if (heap)
+				freeHeapBlock(b);
+			else
+				blocks.release(b);
+		}
 	public:
-		Queue<mobj*> timeQueue;
-		runner(bool newThread=false) {
+		mpsc_queue<mobj, &mobj::qnext> timeQueue;
+		mpsc_queue<mobj, &mobj::cnext> commands; // Timers in the wheel the subsystem has to move or let go of, see cancel and reset
+		mpsc_queue<mobj, &mobj::qnext> readyQueue; // Timed objects the subsystem found to be due. An object is only ever in one of these queues
+		/// <summary>
+		/// Creates a runner, placing it on a numa node keeps its threads on the cpus of that node and takes the memory of its objects from it.
+		/// A runner that is not threaded runs on whatever thread calls loop() or update(), pin that one with SetAffinityNode.
+		/// </summary>
+		/// <param name="node">The numa node to place the runner on, -1 leaves it up to the os</param>
+		/// <param name="options">The cpus and os priorities of the runner's own threads, the thread that calls loop() on a runner that is not threaded is left alone</param>
+		runner(bool newThread = false, int node = -1, const thread_options& options = thread_options()) : threadOptions(options) {
 			if (newThread) {
 				isLocal = false; // Tell the runner that if it's loop() is called it should spawn a thread to run it's code
 			}
-			setScheme(scheduler::round_robin);
-			initSubsystem(); // This pumps some background stuff
+			setNode(node);
+			setScheme(scheduler::round_robin);
+			initSubsystem(); // This pumps some background stuff
+		}
+	private:
+		struct pool_home {}; // Picks the constructor of a runner_pool's home runner
+		// The workers of the pool run the objects and keep their timers, so the home runner starts no threads of its own
+		runner(pool_home, int node) {
+			pooled = true;
+			setNode(node);
+			setScheme(scheduler::round_robin);
+		}
+		void setNode(int node) {
+			if (node >= 0 && (size_t)node < GetTopology().getNodeCount()) {
+				numaNode = node;
+				blocks.setNode(node);
+			}
 		}
+	public:
 		~runner() {
-			// ToDo clean up stuff
+			// ToDo clean up the objects
+			stop = true;
+			timeQueue.wake();
+			readyQueue.wake(); // The loop may be parked
+			if (subsystem) {
+				subsystem->join();
+				delete subsystem;
+			}
+			if (threadedloop) {
+				threadedloop->join();
+				delete threadedloop;
+			}
+			// The blocks go away with the slab, only the nodes are left
+			for (spare_block* n = spares.load(); n;) {
+				spare_block* following = n->next.load(std::memory_order_relaxed);
+				delete n;
+				n = following;
+			}
+			for (spare_block* n = usedSpares.drain_all(); n;) {
+				spare_block* following = usedSpares.next(n);
+				delete n;
+				n = following;
+			}
+			for (auto n : limbo)
+				delete n;
+			for (auto n : freeSpares)
+				delete n;
+#ifdef MULTI_STATS
+			task_stats* s = statsHead.load(std::memory_order_acquire);
+			while (s) {
+				task_stats* next = s->nextStats;
+				delete s;
+				s = next;
+			}
+#endif
 		}
 		inline bool isReady(mobj* m) {
 			return m->ready;
 		}
+		/// <summary>
+		/// Marks a timed object as due, the runner picks it up from the readyQueue on its next pass. Used by the subsystem.
+		/// </summary>
 		inline void setReady(mobj* m, bool r) {
 			m->ready = r;
+			if (r && !pooled)
+				readyQueue.push(m);
 		}
 		template<typename T>
 		inline T* getReserved0(mobj* m) {
@@ -588,53 +3584,226 @@ namespace multi {
 				return nullptr; // You can only touch objects that are within your own runner
 			return (T*)m->hiddendata;
 		}
-		template<typename T>
-		inline T* getReserved1(mobj* m) {
-			if (m->ref != this)
-				return nullptr; // You can only touch objects that are within your own runner
-			return (T*)m->reserved1;
-		}
-		template<typename T>
-		inline T* getReserved2(mobj* m) {
-			if (m->ref != this)
-				return nullptr; // You can only touch objects that are within your own runner
-			return (T*)m->reserved2;
-		}
-		template<typename T>
-		inline T* getReserved3(mobj* m) {
-			if (m->ref != this)
-				return nullptr; // You can only touch objects that are within your own runner
-			return (T*)m->reserved3;
+		/// <summary>
+		/// Gets the point in time a timed object is due
+		/// </summary>
+		inline time getDeadline(mobj* m) {
+			return block(m)->clock.due();
 		}
-		node<mobj>& getHead() {
-			return tasks;
+		task_table& getTasks(priority p = priority::normal) {
+			return tasks[(size_t)p];
 		}
 		size_t getTaskCount() {
-			size_t c=0;
-			node<mobj>* current = tasks.next;
-			while (current != nullptr) { c++; current = current->next; }
+			size_t c = timedCount.load(std::memory_order_relaxed);
+			for (size_t level = 0; level < priority_count; level++)
+				c += tasks[level].size();
 			return c;
 		}
+		/// <summary>
+		/// Pauses or resumes a task, an inactive task stays in the runner but is skipped by the schedulers. Call this from the runner's thread
+		/// </summary>
+		void setActive(mobj* m, bool a) {
+			if (m->ref != this)
+				return; // You can only touch objects that are within your own runner
+			if (m->slot != SIZE_MAX) {
+				tasks[(size_t)m->prio].setActive(m, a);
+				if (a)
+					wakeUp();
+			}
+			else if (m->timed && a && !m->active && m->ready && !m->armed) {
+				// Came due while it was paused
+				m->active = true;
+				m->armed = true;
+				readyQueue.push(m);
+			}
+			else
+				m->active = a;
+		}
+		/// <summary>
+		/// Moves an object to another priority level, only the priority scheduler makes use of it. Can be called from any thread, also from
+		/// a run. From another thread or during a pass the object moves at the start of the next pass, so a pass never runs a task twice or skips one
+		/// </summary>
+		void setPriority(mobj* m, priority p) {
+			if (m->ref != this || pooled)
+				return; // You can only touch objects that are within your own runner, the workers of a pool do not look at priorities
+			if (isOwner() && !passing && !(m->remote.load(std::memory_order_acquire) & queued_bit)) {
+				moveTask(m, p);
+				return;
+			}
+			// Handed over the same way a destroy from another thread is, if it is already queued the runner sees the new level when it takes it in
+			m->wanted.store(p, std::memory_order_relaxed);
+			if (!(m->remote.fetch_or(queued_bit | moved_bit, std::memory_order_acq_rel) & queued_bit)) {
+				remoteQueue.push(m);
+				wakeUp();
+			}
+		}
 		inline void loop() {
 			if (isLocal) {
-				while (!stop) {
-					current(this);
-				}
+				owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+				runLoop();
 				return;
 			}
-			runner_func* fptr = &current; // This is really a pointer to a pointer, wrapped up to look less messy
 			if (threadedloop == nullptr) {
-				threadedloop = new std::thread([](multi::runner* r, runner_func* current) {
-					while (r->isActive()) {
-						(*current)(r);
-					}
-				},this,fptr);
+				owner.store(std::thread::id(), std::memory_order_relaxed); // Nobody until the thread is up, everyone hands their objects over
+				threadedloop = new std::thread([](multi::runner* r) {
+					r->owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+					r->placeThread(r->threadOptions.loop, "runner loop");
+					r->runLoop();
+				},this);
 			}
 		}
+		/// <summary>
+		/// Sets how the loop waits when there is nothing to do, see idle_policy. Defaults to idle_policy::balanced(). Call this before loop()
+		/// </summary>
+		void setIdlePolicy(const idle_policy& p) {
+			idlePolicy = p;
+		}
+		const idle_policy& getIdlePolicy() const {
+			return idlePolicy;
+		}
 		inline bool update() {
-			current(this);
+			owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+			pass();
 			return !stop;
 		}
+		/// <summary>
+		/// Removes an object from the runner, its memory is reused for new objects once the subsystem is done with it.
+		/// Can be called from any thread, from another thread than the runner's the object is taken out at the start of the next pass.
+		/// Destroy an object only once, it must not be touched afterwards.
+		/// </summary>
+		void destroy(mobj* m) {
+			if (m->ref != this)
+				return; // You can only touch objects that are within your own runner
+			if (!isOwner()) {
+				// If it is still on its way in, the runner sees the bit when it takes it in
+				if (!(m->remote.fetch_or(queued_bit | retired_bit, std::memory_order_acq_rel) & queued_bit)) {
+					remoteQueue.push(m);
+					wakeUp();
+				}
+				return;
+			}
+			if (m->remote.load(std::memory_order_acquire) & queued_bit) {
+				m->remote.fetch_or(retired_bit, std::memory_order_acq_rel); // Made by another thread and not taken in yet
+				return;
+			}
+			retire(m);
+		}
+		/// <summary>
+		/// Stops an alarm, tloop or tstep from firing, it is taken out of the timer subsystem right away. The object stays, reset starts it again.
+		/// Call this from the runner's thread. Nothing is searched for, it costs the same no matter how many timers there are
+		/// </summary>
+		/// <returns>True if the timer was still going to fire</returns>
+		bool cancel(mobj* m) {
+			if (m->ref != this || !m->timer)
+				return false; // You can only touch objects that are within your own runner
+			return disarm(m);
+		}
+		/// <summary>
+		/// Starts the countdown of an alarm, tloop or tstep over from now. Also brings back one that was cancelled or that already went off.
+		/// Call this from the runner's thread. A timer that was due already may still fire once for its old deadline
+		/// </summary>
+		void reset(mobj* m) {
+			if (m->ref != this || !m->timer)
+				return; // You can only touch objects that are within your own runner
+			m->cancelled.store(false, std::memory_order_release);
+			time deadline = now() + block(m)->clock.period;
+			if (m->armed)
+				retime(m, deadline);
+			else {
+				block(m)->clock.deadline.store(deadline, std::memory_order_relaxed);
+				m->ready = false;
+				arm(m);
+			}
+		}
+		/// <summary>
+		/// Changes the time between the runs of a tloop or tstep, or the delay of an alarm. The current countdown keeps its start,
+		/// so a timer that is already past the new period fires on the next sweep. A cancelled or finished timer only fires again after reset.
+		/// Call this from the runner's thread
+		/// </summary>
+		template<typename T>
+		void setPeriod(mobj* m, long long set) {
+			if (m->ref != this || !m->timer)
+				return; // You can only touch objects that are within your own runner
+			timed_state& clock = block(m)->clock;
+			Clock::duration old = clock.period;
+			clock.setPeriod<T>(set);
+			if (m->armed && !m->cancelled.load(std::memory_order_relaxed))
+				retime(m, clock.due() - old + clock.period);
+		}
+	private:
+		// Takes an armed object out of the subsystem, see cancel
+		bool disarm(mobj* m) {
+			bool pending = m->armed && !m->cancelled.load(std::memory_order_relaxed);
+			m->cancelled.store(true, std::memory_order_release);
+			if (!m->armed || m->ready)
+				m->ready = false; // Nothing fires it anymore, the dispatch lets go of it if it is waiting in the readyQueue
+			else
+				command(m);
+			return pending;
+		}
+		void retire(mobj* m) {
+			if ((m->timer || m->frame) && m->armed)
+				disarm(m); // The memory comes back as soon as the subsystem lets go of it, not when the old deadline comes around. A task may be asleep in the wheel
+			if (m->slot != SIZE_MAX) {
+				if (passing)
+					tasks[(size_t)m->prio].setActive(m, false); // Taken out once the pass is over
+				else
+					removeTask(m);
+			}
+			if (m->timed)
+				timedCount.fetch_sub(1, std::memory_order_relaxed);
+			if (m->armed && !m->ready && block(m)->waiter && block(m)->waiter->unpark() == m)
+				m->armed = false; // Was parked on its channel, otherwise a sender is handing it back right now
+			m->active = false;
+			node<mobj>& link = block(m)->link;
+			link.data = m;
+			link.next = graveyard;
+			graveyard = &link;
+		}
+	public:
+		/// <summary>
+		/// Gets the number of times this runner had to go to the heap for object memory. Once warmed up, creating and destroying objects
+		/// does not allocate, so this number stops changing.
+		/// </summary>
+		size_t getAllocationCount() const {
+			return blocks.getAllocationCount();
+		}
+		/// <summary>
+		/// Gets the number of object blocks in use, destroyed objects count until their memory is given back. Call this from the runner's thread
+		/// </summary>
+		size_t getObjectCount() const {
+			return blocks.getLiveCount();
+		}
+		/// <summary>
+		/// Gets the numa node the runner was placed on, -1 if it was not placed
+		/// </summary>
+		int getNode() const {
+			return numaNode;
+		}
+		const thread_options& getThreadOptions() const {
+			return threadOptions;
+		}
+#ifdef MULTI_STATS
+		/// <summary>
+		/// Copies the statistics of the runner and of every live object. Safe to call from any thread while the runner is looping,
+		/// the numbers of a task may be a few runs behind. Only available when MULTI_STATS is defined.
+		/// </summary>
+		runner_snapshot getStats() const {
+			runner_snapshot snap;
+			snap.passes = passes.load(std::memory_order_relaxed);
+			snap.uptime = std::chrono::duration_cast<nanoseconds>(Clock::now() - created);
+			sweep.read(snap.sweep);
+			for (task_stats* s = statsHead.load(std::memory_order_acquire); s; s = s->nextStats) {
+				const mobj* owner = s->owner.load(std::memory_order_acquire);
+				if (!owner)
+					continue;
+				snap.tasks.push_back({ owner, s->type.load(std::memory_order_relaxed), {}, {} }); // The histograms are filled in below
+				s->runtime.read(snap.tasks.back().runtime);
+				s->lateness.read(snap.tasks.back().lateness);
+			}
+			return snap;
+		}
+#endif
 		inline bool isActive() {
 			return !stop;
 		}
@@ -643,6 +3812,41 @@ namespace multi {
 				current = round_robin;
 				scheme = s;
 			}
+			else if (s == scheduler::priority) {
+				current = priority_based;
+				scheme = s;
+			}
+		}
+		/// <summary>
+		/// Sets how late the subsystem is allowed to wake up for a timer, timers that expire within this window are handled on the same wake up.
+		/// A larger slack means fewer wake ups at the cost of timer accuracy. Defaults to 0.
+		/// </summary>
+		void setTimerSlack(nanoseconds s) {
+			slack = s.count(); // Picked up the next time the subsystem wakes
+		}
+		nanoseconds getTimerSlack() const {
+			return nanoseconds(slack.load(std::memory_order_relaxed));
+		}
+		/// <summary>
+		/// Picks the clock the deadlines of the timed objects are set and checked with, see clock_source. A source the machine does not have
+		/// falls back to monotonic. Can be changed at any time, every source reads the same time and only differs in cost and resolution.
+		/// </summary>
+		/// <returns>The source that is used</returns>
+		clock_source setClockSource(clock_source s) {
+			GetClockCalibration(); // Done here and not in the middle of a sweep
+			if (!HasClockSource(s))
+				s = clock_source::monotonic;
+			clockSource.store(s, std::memory_order_relaxed);
+			return s;
+		}
+		clock_source getClockSource() const {
+			return clockSource.load(std::memory_order_relaxed);
+		}
+		/// <summary>
+		/// The time according to the clock source of the runner
+		/// </summary>
+		inline time now() const {
+			return Now(clockSource.load(std::memory_order_relaxed));
 		}
 		void setRunner(runner_func run) {
 			scheme = scheduler::custom;
@@ -651,100 +3855,933 @@ namespace multi {
 		template<typename T>
 		mobj* setAlarm(long long set, alarm_event evnt)
 		{
-			auto obj = new mobj("alarm");
-			obj->ref = this;
-			obj->hiddendata = evnt;
-			auto temp = new timer<T>;
-			temp->start();
-			obj->reserved1 = temp;
-			obj->reserved2 = new long long(set);
-			// We need to store the type of this data
-			if (std::is_same<T, nanoseconds>::value) {
-				obj->reserved3 = new char(_nanosecond);
+			auto obj = makeAlarm<T>(set, evnt);
+			timedCount.fetch_add(1, std::memory_order_relaxed);
+			return obj;
+		}
+		/// <summary>
+		/// Sets many alarms at once. They share one reading of the clock and are handed to the subsystem as one chain, so it is woken
+		/// at most once. The alarms count down from the moment of the call. Can be called from any thread, on the runner's thread the
+		/// memory of all of them is reserved up front, other threads get their blocks the way newObject hands them out.
+		/// </summary>
+		/// <param name="out">Gets the objects in the order of specs, may be nullptr</param>
+		template<typename T>
+		void setAlarms(const alarm_spec* specs, size_t n, mobj** out = nullptr)
+		{
+			if (n == 0)
+				return;
+			if (isOwner())
+				blocks.reserve(n); // The slab belongs to the runner's thread
+			time now = this->now();
+			mobj* first = nullptr;
+			mobj* last = nullptr;
+			for (size_t i = 0; i < n; i++) {
+				auto obj = newObject("alarm");
+				initAlarm<T>(obj, specs[i].set, specs[i].evnt, now);
+				obj->data = specs[i].data;
+				obj->armed = true;
+				// Linked newest first, the same way single pushes would have left them
+				obj->qnext.store(first, std::memory_order_relaxed);
+				first = obj;
+				if (!last)
+					last = obj;
+				if (out)
+					out[i] = obj;
 			}
-			if (std::is_same<T, microseconds>::value) {
-				obj->reserved3 = new char(_microsecond);
+			timedCount.fetch_add(n, std::memory_order_relaxed);
+			timeQueue.push_chain(first, last);
+		}
+		template<typename T>
+		std::vector<mobj*> setAlarms(const std::vector<alarm_spec>& specs)
+		{
+			std::vector<mobj*> objs(specs.size());
+			setAlarms<T>(specs.data(), specs.size(), objs.data());
+			return objs;
+		}
+		template<typename T>
+		mobj* newTLoop(long long set, loop_event evnt)
+		{
+			auto obj = makeTLoop<T>(set, evnt);
+			timedCount.fetch_add(1, std::memory_order_relaxed);
+			return obj;
+		}
+		/// <summary>
+		/// Polls evnt on every pass until it returns true, the event is paused after that. Resume it with setActive to wait for it again.
+		/// </summary>
+		mobj* newEvent(basic_event evnt) {
+			auto obj = newObject("event");
+			obj->hiddendata = (void*)evnt;
+			obj->run = [](mobj* self, runner* run) {
+				if (((basic_event)self->hiddendata)(self))
+					run->setActive(self, false);
+				return true;
+			};
+			addTask(obj);
+			return obj;
+		}
+		/// <summary>
+		/// Calls evnt for start, start + count, ... up to and including end. Every pass runs as many iterations as fit in the step budget,
+		/// see setStepBudget. The step is paused once it is done or evnt returns false, resuming it with setActive starts it over.
+		/// </summary>
+		mobj* newStep(int start, int end, int count, step_event evnt) {
+			auto obj = makeStep("step", start, end, count, evnt);
+			obj->run = [](mobj* self, runner* run) {
+				step_state& s = block(self)->step;
+				// Size the batch from what an iteration cost so far, the first pass runs a single iteration to measure it
+				long long budget = std::chrono::duration_cast<nanoseconds>(run->stepBudget).count();
+				size_t batch = 1;
+				if (s.cost > 0 && budget > 0)
+					batch = (size_t)(budget / s.cost) + 1;
+				auto begin = Clock::now();
+				size_t done = 0;
+				bool more = true;
+				while (done < batch && (more = run->stepOnce(self, s)))
+					done++;
+				if (!more)
+					return true; // Finished, the cost of a partial batch says nothing
+				double took = (double)std::chrono::duration_cast<nanoseconds>(Clock::now() - begin).count() / done;
+				s.cost = s.cost > 0 ? s.cost * 0.75 + took * 0.25 : took;
+				return true;
+			};
+			addTask(obj);
+			return obj;
+		}
+		/// <summary>
+		/// Like a step, but it runs one iteration every set seconds. Between iterations it sits in the timer subsystem and costs nothing.
+		/// </summary>
+		mobj* newTStep(double set, int start, int end, int count, step_event evnt) {
+			auto obj = makeStep("tstep", start, end, count, evnt);
+			auto b = block(obj);
+			obj->timed = true;
+			obj->timer = true;
+			b->clock.period = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(set));
+			b->clock.start(now());
+			obj->run = [](mobj* self, runner* run) {
+				if (self->ready) {
+					self->ready = false;
+					self->armed = false;
+					if (run->stepOnce(self, block(self)->step)) {
+						block(self)->clock.start(run->now());
+						run->arm(self);
+					}
+					else
+						self->ready = true; // So that resuming it starts right away
+				}
+				return true;
+			};
+			timedCount.fetch_add(1, std::memory_order_relaxed);
+			arm(obj);
+			return obj;
+		}
+		mobj* newLoop(loop_event evnt) {
+			auto obj = makeLoop(evnt);
+			addTask(obj);
+			return obj;
+		}
+		/// <summary>
+		/// Runs evnt once every skip + 1 passes
+		/// </summary>
+		mobj* newUpdater(int skip, updater_event evnt) {
+			auto obj = newObject("updater");
+			auto& s = block(obj)->step;
+			obj->hiddendata = (void*)evnt;
+			s.skip = skip > 0 ? (uint32_t)skip : 0;
+			s.left = s.skip;
+			obj->run = [](mobj* self, runner* run) {
+				step_state& s = block(self)->step;
+				if (s.left) {
+					s.left--;
+					return true;
+				}
+				s.left = s.skip;
+				return ((updater_event)self->hiddendata)(self);
+			};
+			addTask(obj);
+			return obj;
+		}
+		/// <summary>
+		/// Runs f once on the next pass and returns a future for its result. Can be called from any thread, nothing but the call itself
+		/// is allocated and it never becomes an mobj.
+		/// </summary>
+		template<typename F>
+		auto async(F&& f) -> future<decltype(f())> {
+			typedef decltype(f()) R;
+			auto call = new async_call<R, typename std::decay<F>::type>(typename std::decay<F>::type(std::forward<F>(f)));
+			call->target = this;
+			call->post = postAsync;
+			call->submit();
+			return future<R>(call);
+		}
+		// Hands a call to a runner, used by async and future::then
+		static void postAsync(void* target, async_base* a) {
+			runner* r = static_cast<runner*>(target);
+			r->asyncQueue.push(a);
+			r->wakeUp();
+		}
+		/// <summary>
+		/// Receives the messages of a spsc_channel or mpsc_channel, the runner has to be the only consumer of the channel. handler is
+		/// called with every message in place, it may move out of it. By default the receiver parks on the channel once it is empty and
+		/// the next send hands it back to the runner, so an idle receiver is never looked at. With poll the receiver is an ordinary task
+		/// that checks the channel on every pass instead, which saves the senders a fence but costs every pass a look at the channel.
+		/// At most batch messages are handled per pass.
+		/// </summary>
+		template<typename Channel>
+		mobj* newReceiver(Channel& channel, bool (*handler)(mobj*, typename Channel::value_type&), bool poll = false, size_t batch = 256) {
+			typedef bool (*handler_t)(mobj*, typename Channel::value_type&);
+			auto obj = newObject("receiver");
+			block(obj)->waiter = &channel; // So destroy can take it off the channel without knowing its type
+			obj->hiddendata = (void*)handler;
+			block(obj)->batch = (uint32_t)(batch ? batch : 1);
+			if (poll) {
+				obj->run = [](mobj* self, runner* run) {
+					auto ch = static_cast<Channel*>(block(self)->waiter);
+					auto handler = (handler_t)self->hiddendata;
+					uint32_t n = block(self)->batch;
+					while (n && ch->consume([=](typename Channel::value_type& v) { handler(self, v); }))
+						n--;
+					return true;
+				};
+				addTask(obj);
+				return obj;
 			}
-			if (std::is_same<T, milliseconds>::value) {
-				obj->reserved3 = new char(_millisecond);
+			obj->timed = true; // Only runs when it is handed back, like an alarm
+			obj->run = [](mobj* self, runner* run) {
+				if (!self->ready)
+					return false;
+				self->ready = false;
+				self->armed = false;
+				auto ch = static_cast<Channel*>(block(self)->waiter);
+				auto handler = (handler_t)self->hiddendata;
+				uint32_t n = block(self)->batch;
+				while (n && ch->consume([=](typename Channel::value_type& v) { handler(self, v); }))
+					n--;
+				if (!n) {
+					run->requeue(self); // The batch ran out, there may be more waiting
+					return true;
+				}
+				self->armed = true; // Held by the channel now
+				ch->park(self, [](mobj* m) {
+					m->ref->setReady(m, true);
+				});
+				if (!ch->empty() && ch->unpark() == self)
+					run->requeue(self); // A message came in before we were parked
+				return true;
+			};
+			timedCount.fetch_add(1, std::memory_order_relaxed);
+			requeue(obj);
+			return obj;
+		}
+		/// <summary>
+		/// Sets how long a step may run per pass. The number of iterations that fit is estimated from what the previous passes measured,
+		/// so a cheap step does a lot of work per pass and an expensive one does not hold up the other tasks. 0 runs one iteration per pass.
+		/// Defaults to 100 microseconds.
+		/// </summary>
+		void setStepBudget(microseconds budget) {
+			stepBudget = budget;
+		}
+		microseconds getStepBudget() const {
+			return stepBudget;
+		}
+#ifdef __cpp_impl_coroutine
+		struct sleep_awaiter {
+			runner* run;
+			Clock::duration period;
+			bool await_ready() const noexcept {
+				return period <= Clock::duration::zero();
 			}
-			if (std::is_same<T, seconds>::value) {
-				obj->reserved3 = new char(_second);
+			void await_suspend(std::coroutine_handle<task::promise_type> h) {
+				mobj* m = h.promise().self;
+				auto& clock = block(m)->clock;
+				clock.period = period;
+				clock.start(run->now());
+				run->arm(m); // The subsystem hands it back through the readyQueue
 			}
-			if (std::is_same<T, minutes>::value) {
-				obj->reserved3 = new char(_minute);
+			void await_resume() noexcept {}
+		};
+		struct pass_awaiter {
+			runner* run;
+			bool await_ready() const noexcept {
+				return false;
 			}
-			if (std::is_same<T, hours>::value) {
-				obj->reserved3 = new char(_hour);
+			void await_suspend(std::coroutine_handle<task::promise_type> h) {
+				run->requeue(h.promise().self);
 			}
+			void await_resume() noexcept {}
+		};
+		/// <summary>
+		/// Suspends a task for a while, co_await run.sleep&lt;multi::milliseconds&gt;(5)
+		/// </summary>
+		template<typename T>
+		sleep_awaiter sleep(long long n) {
+			return { this, std::chrono::duration_cast<Clock::duration>(T(n)) };
+		}
+		/// <summary>
+		/// Suspends a task until the next pass of the runner, co_await run.next_pass()
+		/// </summary>
+		pass_awaiter next_pass() {
+			return { this };
+		}
+		/// <summary>
+		/// Schedules a coroutine, it starts on the next pass. The object is destroyed when the coroutine returns
+		/// </summary>
+		mobj* newTask(task t) {
+			auto obj = newObject("task");
+			obj->hiddendata = t.handle.address();
+			obj->frame = true;
+			obj->timed = true;
+			t.handle.promise().self = obj;
+			t.handle = nullptr; // The object owns the frame now
 			obj->run = [](mobj* self, runner* run) {
 				if (self->ready) {
 					self->ready = false;
-					return ((alarm_event)self->hiddendata)(self);
+					self->armed = false;
+					auto h = std::coroutine_handle<>::from_address(self->hiddendata);
+					h.resume();
+					if (h.done())
+						run->destroy(self);
+					return true;
 				}
 				return false;
 			};
-			timeQueue.push(obj);
-			tasks.addNode(obj);
+			timedCount.fetch_add(1, std::memory_order_relaxed);
+			requeue(obj);
+			return obj;
+		}
+		size_t getFrameAllocationCount() const {
+			return frames.getAllocationCount();
+		}
+	private:
+		friend frame_pool* GetFramePool(runner& r);
+		frame_pool frames{ &owner };
+#endif
+	private:
+		// Runs the object on the next pass without going through the subsystem
+		inline void requeue(mobj* obj) {
+#ifdef MULTI_STATS
+			block(obj)->clock.deadline.store(now(), std::memory_order_relaxed); // The lateness is then the time it waited for the pass
+#endif
+			obj->ready = true;
+			obj->armed = true;
+			readyQueue.push(obj);
+		}
+		microseconds stepBudget{ 100 };
+		mobj* makeStep(const char* type, int start, int end, int count, step_event evnt) {
+			auto obj = newObject(type);
+			auto& s = block(obj)->step;
+			obj->hiddendata = (void*)evnt;
+			s.start = start;
+			s.end = end;
+			s.count = count ? count : (start <= end ? 1 : -1);
+			s.current = start;
+			return obj;
+		}
+		// Runs one iteration of a step, once it is done the step is rewound and paused and false is returned
+		bool stepOnce(mobj* self, step_state& s) {
+			bool more = ((step_event)self->hiddendata)(self, (size_t)s.current);
+			s.current += s.count;
+			if (more && (s.count > 0 ? s.current <= s.end : s.current >= s.end))
+				return true;
+			s.current = s.start;
+			setActive(self, false);
+			return false;
+		}
+		// These build the objects and arm their timers, but do not add them to the tasks
+		mobj* makeLoop(loop_event evnt) {
+			auto obj = newObject("loop");
+			obj->hiddendata = (void*)evnt;
+			obj->run = [](mobj* self, runner* run) {
+				return ((loop_event)self->hiddendata)(self);
+			};
 			return obj;
 		}
 		template<typename T>
-		mobj* newTLoop(long long set, loop_event evnt)
+		mobj* makeAlarm(long long set, alarm_event evnt)
 		{
-			auto obj = new mobj("tloop");
-			obj->ref = this;
-			obj->hiddendata = evnt;
-			auto temp = new timer<T>;
-			temp->start();
-			obj->reserved1 = temp;
-			obj->reserved2 = new long long(set);
-			// We need to store the type of this data
-			if (std::is_same<T, nanoseconds>::value) {
-				obj->reserved3 = new char(_nanosecond);
-			}
-			if (std::is_same<T, microseconds>::value) {
-				obj->reserved3 = new char(_microsecond);
-			}
-			if (std::is_same<T, milliseconds>::value) {
-				obj->reserved3 = new char(_millisecond);
-			}
-			if (std::is_same<T, seconds>::value) {
-				obj->reserved3 = new char(_second);
-			}
-			if (std::is_same<T, minutes>::value) {
-				obj->reserved3 = new char(_minute);
-			}
-			if (std::is_same<T, hours>::value) {
-				obj->reserved3 = new char(_hour);
-			}
+			auto obj = newObject("alarm");
+			initAlarm<T>(obj, set, evnt, now());
+			arm(obj);
+			return obj;
+		}
+		template<typename T>
+		void initAlarm(mobj* obj, long long set, alarm_event evnt, time now) {
+			auto b = block(obj);
+			obj->hiddendata = (void*)evnt;
+			obj->timed = true;
+			obj->timer = true;
+			// The unit is only needed here, from now on the timer is a time point
+			b->clock.setPeriod<T>(set);
+			b->clock.start(now);
+			obj->run = [](mobj* self, runner* run) {
+				if (self->ready) {
+					self->ready = false;
+					self->armed = false;
+					return ((alarm_event)self->hiddendata)(self);
+				}
+				return false;
+			};
+		}
+		template<typename T>
+		mobj* makeTLoop(long long set, loop_event evnt)
+		{
+			auto obj = newObject("tloop");
+			auto b = block(obj);
+			obj->hiddendata = (void*)evnt;
+			obj->timed = true;
+			obj->timer = true;
+			// The unit is only needed here, from now on the timer is a time point
+			b->clock.setPeriod<T>(set);
+			b->clock.start(now());
 			obj->run = [](mobj* self,runner* run) {
 				if (self->ready) {
 					self->ready = false;
-					// Turns out we can cast this as something else thats similar if we only call the start function
-					auto tmp = run->getReserved1<timer<microseconds>>(self);
-					tmp->start();
-					run->timeQueue.push(self);
+					block(self)->clock.start(run->now());
+					run->arm(self);
 					return ((loop_event)self->hiddendata)(self);
 				}
 				return false;
 			};
-			timeQueue.push(obj);
-			tasks.addNode(obj);
+			arm(obj);
 			return obj;
 		}
-		mobj* newEvent(basic_event evnt);
-		mobj* newStep(int start, int end, int count, step_event evnt);
-		mobj* newTStep(double set, int start, int end, int count, step_event evnt);
-		mobj* newLoop(loop_event evnt) {
-			auto obj = new mobj("loop");
-			obj->ref = this;
-			obj->hiddendata = evnt;
-			obj->run = [](mobj* self, runner* run) {
-				return ((loop_event)self->hiddendata)(self);
+	};
+#ifdef __cpp_impl_coroutine
+	// The frame pool of a runner, nullptr on other threads than the runner's, their frames come from the heap
+	inline frame_pool* GetFramePool(runner& r) {
+		return r.frames.isOwner() ? &r.frames : nullptr;
+	}
+#endif
+	/// <summary>
+	/// One call of runner_pool::parallel_for and friends. The range is cut into one piece per worker plus one for the calling thread.
+	/// Everyone eats its own piece from the front in shrinking chunks, then takes half of what is left of the biggest remaining piece
+	/// </summary>
+	template<typename Chunk>
+	class parallel_job {
+		struct alignas(64) piece {
+			std::atomic<size_t> next{ 0 };
+			size_t end = 0;
+		};
+		// What a worker gets in its async queue, it may only get to it once everything is done
+		struct part : async_base {
+			parallel_job* job = nullptr;
+			size_t slot = 0;
+			void run() override {
+				job->join(slot);
+				job->release();
+			}
+		};
+		std::unique_ptr<piece[]> pieces;
+		std::unique_ptr<part[]> parts;
+		size_t count;
+		size_t grain;
+		Chunk& chunk; // Lives on the callers stack, only touched while active is raised
+		std::atomic<size_t> active{ 0 };
+		std::atomic<bool> done{ false };
+		std::atomic<size_t> refs;
+		bool claim(piece& p, size_t share, size_t& lo, size_t& hi) {
+			size_t cur = p.next.load(std::memory_order_relaxed);
+			while (cur < p.end) {
+				size_t take = (std::min)(p.end - cur, (std::max)(grain, (p.end - cur) / share));
+				if (p.next.compare_exchange_weak(cur, cur + take, std::memory_order_relaxed)) {
+					lo = cur;
+					hi = cur + take;
+					return true;
+				}
+			}
+			return false;
+		}
+		void work(size_t slot) {
+			size_t lo, hi;
+			while (claim(pieces[slot], 8, lo, hi))
+				chunk(lo, hi, slot);
+			// Our piece is gone, help whoever has the most left
+			for (;;) {
+				size_t victim = count, most = 0;
+				for (size_t i = 0; i < count; i++) {
+					size_t at = pieces[i].next.load(std::memory_order_relaxed);
+					if (at < pieces[i].end && pieces[i].end - at > most) {
+						most = pieces[i].end - at;
+						victim = i;
+					}
+				}
+				if (victim == count)
+					return;
+				if (claim(pieces[victim], 2, lo, hi))
+					chunk(lo, hi, slot);
+			}
+		}
+		void join(size_t slot) {
+			active.fetch_add(1, std::memory_order_seq_cst);
+			if (!done.load(std::memory_order_seq_cst))
+				work(slot);
+			active.fetch_sub(1, std::memory_order_release);
+		}
+	public:
+		/// <summary>
+		/// Splits [0, n) over count slots, the last slot belongs to the calling thread
+		/// </summary>
+		parallel_job(size_t n, size_t grain, size_t count, Chunk& chunk) : pieces(new piece[count]), parts(new part[count - 1]),
+			count(count), grain(grain), chunk(chunk), refs(count) {
+			size_t each = n / count, extra = n % count, at = 0;
+			for (size_t i = 0; i < count; i++) {
+				pieces[i].next.store(at, std::memory_order_relaxed);
+				at += each + (i < extra ? 1 : 0);
+				pieces[i].end = at;
+			}
+			for (size_t i = 0; i + 1 < count; i++) {
+				parts[i].job = this;
+				parts[i].slot = i;
+			}
+		}
+		async_base* getPart(size_t i) {
+			return &parts[i];
+		}
+		/// <summary>
+		/// The calling thread works along and returns once every chunk has been run. Workers that never got to their part skip it later
+		/// </summary>
+		void run() {
+			work(count - 1);
+			done.store(true, std::memory_order_seq_cst);
+			while (active.load(std::memory_order_seq_cst) != 0)
+				std::this_thread::yield();
+		}
+		void release() {
+			if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				delete this;
+		}
+	};
+	/// <summary>
+	/// A group of worker threads, by default one per logical core, that share the tasks given to the pool. Every worker is pinned to its own core
+	/// and keeps its tasks in a work stealing deque. A worker that runs dry, or has far fewer tasks than a neighbour, steals from the others
+	/// so the work spreads out over the cores. Timed objects are kept in a timer wheel of the worker they were handed to, they are never
+	/// stolen and cost nothing until they are due, so a worker with only timers parks until the next deadline.
+	/// </summary>
+	class runner_pool {
+		struct worker {
+			ws_deque<mobj> tasks;
+			mpsc_queue<mobj, &mobj::snext> inbox; // New tasks handed to this worker from other threads
+			mpsc_queue<async_base, &async_base::next> async; // Calls handed to this worker, see async
+			std::atomic<bool> parked{ false };
+			std::atomic<size_t> timers{ 0 }; // Objects in the worker's wheel, only a snapshot for getTaskCount
+			std::thread* thread = nullptr;
+			uint32_t index = 0;
+			uint32_t core = 0;
+			uint32_t node = 0;
+#ifdef MULTI_STATS
+			std::atomic<uint64_t> passes{ 0 };
+#endif
+		};
+		runner home; // Owns the objects, it never loops itself and starts no threads. The workers keep the timers in their own wheels
+		mpsc_queue<mobj, &mobj::cnext> buried; // Destroyed objects the workers let go of, their memory goes back on the thread that made the pool
+		std::vector<worker*> workers;
+		std::vector<std::vector<size_t>> nodeWorkers; // The workers of each numa node
+		std::vector<size_t> allWorkers;
+		std::atomic<bool> stop{ false };
+		std::atomic<size_t> nextWorker{ 0 };
+		std::optional<priority> workerPriority; // Unset leaves the workers as the os made them
+		static void work(runner_pool* pool, size_t id) {
+			worker* self = pool->workers[id];
+			SetAffinityCore(self->core);
+			if (pool->workerPriority)
+				SetOsPriority(*pool->workerPriority); // Before the first task runs
+			self->tasks.rehome(); // The deque was built by the constructing thread, now that we are pinned its buffer comes from our node
+#ifdef MULTI_TRACE
+			SetTraceThreadName("pool worker");
+#endif
+			runner& home = pool->home;
+			timer_wheel timedObjects(home.now()); // Built by the worker itself, so it sits on its node
+			std::vector<mobj*> ran, due;
+			uint64_t seed = id * 0x9E3779B97F4A7C15ULL + 1;
+			size_t idle = 0;
+			while (pool->isActive()) {
+				async_base* a = self->async.drain_all();
+				bool called = a != nullptr;
+				while (a) {
+					async_base* following = self->async.next(a); // Running it may free it
+					a->run();
+					a = following;
+				}
+				mobj* m = self->inbox.drain_all();
+				while (m) {
+					mobj* following = self->inbox.next(m);
+					// From here on a destroy or resume from another thread hands it to us again
+					if (m->remote.fetch_and((uint8_t)~runner::queued_bit, std::memory_order_acq_rel) & runner::retired_bit) {
+						timedObjects.cancel(m);
+						pool->buried.push(m);
+					}
+					else if (!m->timed)
+						self->tasks.push(m);
+					else if (m->armed)
+						timedObjects.insert(m, home.getDeadline(m)); // New, or resumed while it was still waiting
+					else if (m->ready && m->active.load(std::memory_order_relaxed)) {
+						m->armed = true; // Came due while it was paused, its deadline has passed so it runs right away
+						timedObjects.insert(m, home.getDeadline(m));
+					}
+					m = following;
+				}
+				// Run what came due, a tloop arms itself again while it runs and goes back into the wheel with its new deadline
+				time now = home.now();
+				timedObjects.advance(now, [&due, &home, now](mobj* t) {
+#ifdef MULTI_TRACE
+					Trace(trace_kind::expire, t, &home, t->type, home.getDeadline(t), now);
+#else
+					(void)home;
+					(void)now;
+#endif
+					t->ready = true;
+					due.push_back(t);
+				});
+				bool fired = !due.empty();
+				for (mobj* t : due) {
+					if (!t->active.load(std::memory_order_relaxed) || (t->remote.load(std::memory_order_acquire) & runner::retired_bit)) {
+						t->armed = false; // Paused or destroyed, it stays ready until it is resumed. A destroy lets go of it through our inbox
+						continue;
+					}
+#ifdef MULTI_STATS
+					auto late = std::chrono::duration_cast<nanoseconds>(home.now() - home.getDeadline(t)).count();
+					t->stats->lateness.record(late > 0 ? (uint64_t)late : 0);
+#endif
+					RunObject(t, t->ref);
+					if (t->armed)
+						timedObjects.insert(t, home.getDeadline(t));
+				}
+				due.clear();
+				self->timers.store(timedObjects.size(), std::memory_order_relaxed);
+				// One pass over our tasks, thieves can take from the other end of the deque while we work
+				bool worked = false;
+				while ((m = self->tasks.take()) != nullptr) {
+					if (m->remote.load(std::memory_order_acquire) & runner::retired_bit) {
+						pool->buried.push(m); // Destroyed, whoever holds it next lets go of it
+						continue;
+					}
+					if (m->active.load(std::memory_order_relaxed)) {
+						RunObject(m, m->ref);
+						worked = true;
+					}
+					ran.push_back(m);
+				}
+				for (auto it = ran.rbegin(); it != ran.rend(); ++it)
+					self->tasks.push(*it);
+#ifdef MULTI_STATS
+				self->passes.store(self->passes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+#endif
+				size_t mine = ran.size();
+				ran.clear();
+				// Pick a random neighbour and take one of its tasks if we ran dry or it has at least two more than we do.
+				// Most of the time the neighbour is on our own numa node, so the tasks and their memory stay close
+				bool stole = false;
+				seed ^= seed << 13;
+				seed ^= seed >> 7;
+				seed ^= seed << 17;
+				auto& near = pool->nodeWorkers[self->node];
+				auto& pick = (near.size() > 1 && (seed >> 32) & 7) ? near : pool->allWorkers;
+				size_t v = pick[seed % pick.size()];
+				if (v != id) {
+					size_t theirs = pool->workers[v]->tasks.size();
+					if (theirs > mine + 1 || (mine == 0 && theirs)) {
+						if ((m = pool->workers[v]->tasks.steal()) != nullptr) {
+							self->tasks.push(m);
+							stole = true;
+						}
+					}
+				}
+				if (worked || stole || called || fired) {
+					idle = 0;
+				}
+				else if (++idle < 1024) {
+					std::this_thread::yield();
+				}
+				else {
+					// Nothing to do for a while, park until a task is handed to us or a timer is due, but look for something to steal every millisecond
+					time wake = Clock::now() + milliseconds(1);
+					time next;
+					if (timedObjects.nextEvent(next)) {
+						time deadline = Clock::now() + (next - home.now()) + home.getTimerSlack(); // The wait needs a time of Clock, the source may drift from it
+						if (deadline < wake)
+							wake = deadline;
+					}
+					self->parked.store(true, std::memory_order_seq_cst);
+					if (self->async.empty())
+						self->inbox.wait_until(wake);
+					self->parked.store(false, std::memory_order_relaxed);
+				}
+			}
+		}
+		// New work goes to a worker on the caller's numa node when the pool has one there
+		worker* pickWorker() {
+			size_t node = (size_t)GetCurrentNode();
+			auto& pick = node < nodeWorkers.size() && !nodeWorkers[node].empty() ? nodeWorkers[node] : allWorkers;
+			return workers[pick[nextWorker++ % pick.size()]];
+		}
+		void submit(mobj* m) {
+			worker* w = pickWorker();
+			runner::block(m)->worker = w->index;
+			m->remote.fetch_or(runner::queued_bit, std::memory_order_relaxed);
+			w->inbox.push(m);
+		}
+		// Gives the memory of the objects the workers let go of back, only the thread that made the pool may touch the slab
+		void reclaim() {
+			mobj* m = buried.drain_all();
+			while (m) {
+				mobj* following = buried.next(m);
+				home.freeObject(m);
+				m = following;
+			}
+		}
+		// Hands a timed object back to the worker whose wheel keeps it, unless it is already on its way there
+		void notify(mobj* m, uint8_t bits) {
+			worker* w = workers[runner::block(m)->worker];
+			if (!(m->remote.fetch_or(runner::queued_bit | bits, std::memory_order_acq_rel) & runner::queued_bit)) {
+				w->inbox.push(m); // Wakes the worker if it is parked
+			}
+		}
+		static void hand(worker* w, async_base* a) {
+			w->async.push(a);
+			if (w->parked.load(std::memory_order_seq_cst))
+				w->inbox.wake();
+		}
+		// Runs chunk(lo, hi, slot) over [0, n) on every worker and the calling thread, slot tells the threads apart
+		template<typename Chunk>
+		void parallel(size_t n, size_t grain, Chunk& chunk) {
+			size_t count = workers.size() + 1;
+			if (grain == 0)
+				grain = (std::max)(n / (count * 256), (size_t)1);
+			if (n <= grain) {
+				if (n)
+					chunk(0, n, count - 1); // Not worth waking anyone
+				return;
+			}
+			auto job = new parallel_job<Chunk>(n, grain, count, chunk);
+			for (size_t i = 0; i < workers.size(); i++)
+				hand(workers[i], job->getPart(i));
+			job->run();
+			job->release();
+		}
+	public:
+		/// <summary>
+		/// Starts the workers and pins each of them to a core
+		/// </summary>
+		/// <param name="physical">Start one worker per physical core instead of one per logical core, so no two workers share a core</param>
+		/// <param name="count">Number of workers to start, 0 picks the core count</param>
+		/// <param name="node">Only use the cores of this numa node, the objects and the timer thread are placed on it too. -1 uses every node, the objects then come from wherever the os hands out heap memory</param>
+		/// <param name="prio">How the os schedules the workers, see SetOsPriority. When not set the workers keep what they inherited</param>
+		runner_pool(bool physical = false, uint32_t count = 0, int node = -1, std::optional<priority> prio = std::nullopt) : home(runner::pool_home(), node), workerPriority(prio) {
+			// Hand out the first sibling of every core before any second sibling, so hyperthreads are only shared once every core is in use
+			auto& topo = GetTopology();
+			std::vector<uint32_t> order;
+			for (size_t rank = 0; rank == 0 || (!physical && order.size() < topo.getLogicalCoreCount()); rank++)
+				for (auto& core : topo.cores) {
+					auto siblings = core.list();
+					if (rank < siblings.size() && (node < 0 || topo.nodeOf(siblings[rank]) == (uint32_t)node))
+						order.push_back(siblings[rank]);
+				}
+			if (order.empty())
+				order.push_back(0);
+			if (count == 0)
+				count = (uint32_t)order.size();
+			nodeWorkers.resize(topo.getNodeCount() ? topo.getNodeCount() : 1);
+			for (uint32_t i = 0; i < count; i++) {
+				uint32_t core = order[i % order.size()];
+				uint32_t n = topo.nodeOf(core);
+				// Every worker struct gets its own pages on its own node, its queues are touched all the time by that worker only. The deque buffer is moved over by the worker itself
+				auto w = new (AllocateOnNode(sizeof(worker), (int)n)) worker;
+				w->index = i;
+				w->core = core;
+				w->node = n < nodeWorkers.size() ? n : 0;
+				nodeWorkers[w->node].push_back(i);
+				allWorkers.push_back(i);
+				workers.push_back(w);
+			}
+			for (size_t i = 0; i < workers.size(); i++)
+				workers[i]->thread = new std::thread(work, this, i);
+		}
+		~runner_pool() {
+			// ToDo clean up the objects
+			stop = true;
+			for (auto w : workers)
+				w->inbox.wake();
+			for (auto w : workers)
+				w->thread->join(); // Everyone has to be done before a deque goes away, a thief could still be looking at it
+			for (auto w : workers) {
+				// Calls that were handed over too late still run, someone may be waiting on them. Parts of a parallel_for just let go of their job
+				async_base* a = w->async.drain_all();
+				while (a) {
+					async_base* following = w->async.next(a);
+					a->run();
+					a = following;
+				}
+				delete w->thread;
+				w->~worker();
+				FreeOnNode(w, sizeof(worker));
+			}
+			reclaim();
+		}
+		runner_pool(const runner_pool&) = delete;
+		runner_pool& operator=(const runner_pool&) = delete;
+		inline bool isActive() {
+			return !stop;
+		}
+		size_t getWorkerCount() const {
+			return workers.size();
+		}
+		/// <summary>
+		/// Gets the number of object blocks in use that came from the pool's slab, see runner::getObjectCount. Call this from the thread that made the pool
+		/// </summary>
+		size_t getObjectCount() {
+			reclaim();
+			return home.getObjectCount();
+		}
+		/// <summary>
+		/// Gets the numa node the pool was placed on, -1 if it uses every node
+		/// </summary>
+		int getNode() const {
+			return home.blocks.getNode();
+		}
+		/// <summary>
+		/// Gets the number of tasks sitting in the workers deques and timer wheels, this is only a snapshot and misses the tasks that are being run right now
+		/// </summary>
+		size_t getTaskCount() const {
+			size_t c = 0;
+			for (auto w : workers)
+				c += w->tasks.size() + w->timers.load(std::memory_order_relaxed);
+			return c;
+		}
+		void setTimerSlack(nanoseconds s) {
+			home.setTimerSlack(s);
+		}
+		clock_source setClockSource(clock_source s) {
+			return home.setClockSource(s);
+		}
+		/// <summary>
+		/// Runs f once on one of the workers and returns a future for its result, see runner::async
+		/// </summary>
+		template<typename F>
+		auto async(F&& f) -> future<decltype(f())> {
+			typedef decltype(f()) R;
+			auto call = new async_call<R, typename std::decay<F>::type>(typename std::decay<F>::type(std::forward<F>(f)));
+			call->target = this;
+			call->post = postAsync;
+			call->submit();
+			return future<R>(call);
+		}
+		// Hands a call to a worker, used by async and future::then
+		static void postAsync(void* target, async_base* a) {
+			hand(static_cast<runner_pool*>(target)->pickWorker(), a);
+		}
+		/// <summary>
+		/// Calls f(i) for every i in [begin, end). The range is split over the workers and the calling thread, which works along instead of
+		/// waiting and returns once every call is done. Workers that finish early take chunks from the ones that are behind
+		/// </summary>
+		/// <param name="grain">Smallest number of indices handed out at once, 0 picks one from the size of the range</param>
+		template<typename F>
+		void parallel_for(size_t begin, size_t end, F&& f, size_t grain = 0) {
+			auto chunk = [&](size_t lo, size_t hi, size_t) {
+				for (size_t i = begin + lo; i < begin + hi; i++)
+					f(i);
+			};
+			parallel(end > begin ? end - begin : 0, grain, chunk);
+		}
+		/// <summary>
+		/// Folds every i in [begin, end) into a value, acc = f(acc, i). Every thread folds into its own value starting from identity,
+		/// combine merges those at the end so it should not care about the order
+		/// </summary>
+		template<typename T, typename F, typename C>
+		T parallel_reduce(size_t begin, size_t end, T identity, F&& f, C&& combine, size_t grain = 0) {
+			struct alignas(64) partial {
+				T value;
+			};
+			std::vector<partial> partials(workers.size() + 1, partial{ identity });
+			auto chunk = [&](size_t lo, size_t hi, size_t slot) {
+				T acc = std::move(partials[slot].value);
+				for (size_t i = begin + lo; i < begin + hi; i++)
+					acc = f(std::move(acc), i);
+				partials[slot].value = std::move(acc);
 			};
-			obj->data = tasks.addNode(obj); // Set pointer to the node
+			parallel(end > begin ? end - begin : 0, grain, chunk);
+			T result = std::move(identity);
+			for (auto& p : partials)
+				result = combine(std::move(result), std::move(p.value));
+			return result;
+		}
+		/// <summary>
+		/// out[i] = f(first[i]) for every element of [first, last), like std::transform. Both iterators have to be random access
+		/// </summary>
+		template<typename In, typename Out, typename F>
+		Out parallel_transform(In first, In last, Out out, F&& f, size_t grain = 0) {
+			size_t n = (size_t)(last - first);
+			auto chunk = [&](size_t lo, size_t hi, size_t) {
+				In in = first + lo;
+				Out to = out + lo;
+				for (size_t i = lo; i < hi; i++, ++in, ++to)
+					*to = f(*in);
+			};
+			parallel(n, grain, chunk);
+			return out + n;
+		}
+#ifdef MULTI_STATS
+		/// <summary>
+		/// Copies the statistics of the pool, the passes are summed over the workers. See runner::getStats
+		/// </summary>
+		runner_snapshot getStats() const {
+			runner_snapshot snap = home.getStats();
+			snap.passes = 0;
+			for (auto w : workers)
+				snap.passes += w->passes.load(std::memory_order_relaxed);
+			return snap;
+		}
+#endif
+		mobj* newLoop(loop_event evnt) {
+			if (home.isOwner())
+				reclaim();
+			auto obj = home.makeLoop(evnt);
+			submit(obj);
+			return obj;
+		}
+		template<typename T>
+		mobj* setAlarm(long long set, alarm_event evnt) {
+			if (home.isOwner())
+				reclaim();
+			auto obj = home.makeAlarm<T>(set, evnt);
+			submit(obj);
+			return obj;
+		}
+		template<typename T>
+		mobj* newTLoop(long long set, loop_event evnt) {
+			if (home.isOwner())
+				reclaim();
+			auto obj = home.makeTLoop<T>(set, evnt);
+			submit(obj);
 			return obj;
 		}
-		mobj* newUpdater(int skip, updater_event evnt);
+		/// <summary>
+		/// Removes an object from the pool. Can be called from any thread, also from the object's own run. The worker that holds the object
+		/// lets go of it on its next pass, a timed object is taken out of its worker's wheel right away. The memory is reused once the thread
+		/// that made the pool makes or destroys another object, or when the pool goes away. Destroy an object only once, it must not be touched afterwards.
+		/// </summary>
+		void destroy(mobj* m) {
+			if (m->ref != &home)
+				return; // You can only touch objects that are within this pool
+			if (!m->timed)
+				m->remote.fetch_or(runner::retired_bit, std::memory_order_acq_rel); // Whoever takes it out of a deque or an inbox next sees the bit
+			else
+				notify(m, runner::retired_bit);
+			if (home.isOwner())
+				reclaim();
+		}
+		/// <summary>
+		/// Pauses or resumes an object, the workers skip paused objects. A timed object that came due while it was paused runs once it is resumed.
+		/// Can be called from any thread
+		/// </summary>
+		void setActive(mobj* m, bool a) {
+			if (m->ref != &home)
+				return; // You can only touch objects that are within this pool
+			m->active.store(a, std::memory_order_release);
+			if (a && m->timed)
+				notify(m, 0);
+			else if (a) {
+				for (auto w : workers)
+					if (w->parked.load(std::memory_order_seq_cst))
+						w->inbox.wake(); // Any of them may hold it
+			}
+		}
 	};
 }
\ No newline at end of file